@@ -0,0 +1,95 @@
+/*
+ * The decoder as a coroutine, see async.h. Rows are only handed to
+ * decode_row() once all their bytes are in, so the row decoder itself runs
+ * exactly as in vpeg_decode_indexed() and never sees a partial row.
+ */
+
+#include <string.h>
+#include <new>
+
+#include "async.h"
+
+// Makes room for rows of pixels [0, height), keeping what is decoded and
+// doubling the allocation so that growing row by row stays linear. Fails
+// past VPEG_MAX_PIXELS or when the allocation does, keeping the frame.
+static int grow_frame(frame_t &f, int height, int &capacity)
+{
+    if ((long) f.stride * height > VPEG_MAX_PIXELS)
+        return -1;
+    if (height > capacity) {
+        int rows = capacity * 2 > height ? capacity * 2 : height;
+        if ((long) f.stride * rows > VPEG_MAX_PIXELS)
+            rows = height;
+        unsigned char *pixels = new (std::nothrow) unsigned char[(size_t) f.stride * rows];
+        if (!pixels)
+            return -1;
+        memcpy(pixels, f.pixels, (size_t) f.stride * f.height);
+        memset(pixels + (size_t) f.stride * f.height, 0,
+               (size_t) f.stride * (rows - f.height));
+        delete[] f.pixels;
+        f.pixels = pixels;
+        capacity = rows;
+    }
+    f.height = height;
+    return 0;
+}
+
+decode_task vpeg_decode_async(decode_input_t &in, frame_t &f, double slice)
+{
+    double t0 = now_seconds();
+    f.pixels = NULL;
+    f.width = f.height = f.stride = 0;
+
+    /* The block size header, if any, is the first thing in the stream. */
+    while (in.data.size() < 2 && !in.eof) {
+        co_await decode_task::pause { DECODE_NEED_INPUT };
+        t0 = now_seconds();
+    }
+    int n = parse_block_size(in.data.data(), in.data.size());
+    if (n < 0)
+        co_return -1;
+
+    int capacity = 0;
+    size_t p = stream_start(in.data.data(), in.data.size());
+    for (int row = 0; ; row++) {
+        size_t end, at = p;
+        int blocks = 0, overflow = 0, ret;
+        while ((ret = scan_row(in.data.data(), in.data.size(), at, n * n, end,
+                               blocks, overflow)) == 0) {
+            if (in.eof)
+                co_return -1;
+            /* Only what was incomplete is scanned again. */
+            at = end;
+            co_await decode_task::pause { DECODE_NEED_INPUT };
+            t0 = now_seconds();
+        }
+        if (ret < 0)
+            co_return -1;
+
+        if (blocks) {
+            if (!f.pixels) {
+                f.width = f.stride = blocks * n;
+                f.pixels = new unsigned char[0];
+            }
+            if (grow_frame(f, (row + 1) * n, capacity) < 0)
+                co_return -1;
+            if (n == 8 && !overflow)
+                decode_row(in.data.data() + p, f, row);
+            else if (n == 8)
+                decode_row_checked(in.data.data() + p, f, row);
+            else
+                decode_row_n(in.data.data() + p, n, f, row);
+        }
+        if (ret == 2)
+            break;
+        p = end;
+
+        if (now_seconds() - t0 > slice) {
+            co_await decode_task::pause { DECODE_YIELDED };
+            t0 = now_seconds();
+        }
+    }
+    if (!f.pixels)
+        frame_alloc(f, 0, 0);
+    co_return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Decoding as a C++20 coroutine, for callers that run an event loop and
+ * cannot block in vpeg_decode(). The event loop appends bytes to a
+ * decode_input_t as they arrive and calls resume(); the decoder runs until
+ * it needs bytes that are not there yet, has used up its time slice, or is
+ * done, and says which.
+ */
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <coroutine>
+#include <vector>
+
+#include "vpeg.h"
+
+enum {
+    DECODE_NEED_INPUT,      // waiting for more bytes, resume after adding some
+    DECODE_YIELDED,         // time slice used up, resume when convenient
+    DECODE_DONE,
+    DECODE_FAILED
+};
+
+// Bytes received so far. Set eof once no more are coming, so a truncated
+// stream fails instead of waiting forever.
+struct decode_input_t {
+    std::vector<unsigned char> data;
+    int eof;
+};
+
+class decode_task {
+public:
+    struct promise_type {
+        int state = DECODE_NEED_INPUT;
+        decode_task get_return_object()
+        {
+            return decode_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(int ret) { state = ret < 0 ? DECODE_FAILED : DECODE_DONE; }
+        void unhandled_exception() { state = DECODE_FAILED; }
+    };
+
+    // What co_await pause(state) suspends on.
+    struct pause {
+        int state;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<promise_type> h) noexcept
+        {
+            h.promise().state = state;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    explicit decode_task(std::coroutine_handle<promise_type> h) : h(h) {}
+    decode_task(decode_task &&t) noexcept : h(t.h) { t.h = nullptr; }
+    decode_task(const decode_task &) = delete;
+    decode_task &operator=(const decode_task &) = delete;
+    ~decode_task()
+    {
+        if (h)
+            h.destroy();
+    }
+
+    // Runs the decoder to its next suspension and returns one of DECODE_*.
+    int resume()
+    {
+        if (!h.done())
+            h.resume();
+        return h.promise().state;
+    }
+
+private:
+    std::coroutine_handle<promise_type> h;
+};
+
+// Decodes the stream arriving in in, a row of blocks at a time, into f,
+// which it allocates: as wide as the first row, growing downwards as rows
+// come in. Free it with frame_free(), whether decoding failed or not. A
+// resume that has decoded rows for more than slice seconds yields before
+// starting the next one.
+decode_task vpeg_decode_async(decode_input_t &in, frame_t &f, double slice);
+
+#endif
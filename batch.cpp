@@ -0,0 +1,375 @@
+/*
+ * Batch decoding of many files.
+ *
+ * One thread owns an io_uring and keeps up to depth files in flight: it
+ * queues reads of upcoming inputs into registered buffers, hands finished
+ * reads to the decode workers, and queues writes of the PGM files they
+ * produce. Workers wake it through an eventfd that has a read pending in
+ * the same ring. Without io_uring every worker reads, decodes and writes
+ * its own files with blocking calls, as they do when the kernel cannot
+ * read or write through the ring.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "vpeg.h"
+#include "uring.h"
+
+// Inputs up to this size are read into a registered buffer.
+#define SLOT_SIZE (128 * 1024)
+
+struct batch_job_t {
+    int index;
+    int fd;
+    int slot;                           // registered buffer, or -1
+    std::vector<unsigned char> heap;    // input too large for a slot
+    unsigned char *in;
+    size_t in_size, in_done;
+    std::vector<unsigned char> out;     // PGM header and pixels
+    size_t out_done;
+    int failed;
+};
+
+struct batch_t {
+    char **inputs;
+    int count;
+    const char *outdir;
+    std::atomic<int> failures;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<batch_job_t *> decode_queue, done_queue;
+    int efd;
+    uint64_t counter;                   // target of the eventfd read
+};
+
+static void output_path(const batch_t &b, int index, char *path, size_t size)
+{
+    const char *name = strrchr(b.inputs[index], '/');
+    name = name ? name + 1 : b.inputs[index];
+    int len = strlen(name);
+    const char *dot = strrchr(name, '.');
+    if (dot)
+        len = dot - name;
+    snprintf(path, size, "%s/%.*s.pgm", b.outdir, len, name);
+}
+
+// Decodes job->in into job->out as a complete PGM file. Streams too large
+// to decode fail like malformed ones, and only this job with them.
+static void decode_job(batch_job_t *job)
+{
+    stream_index_t idx;
+    if (vpeg_index(job->in, job->in_size, idx) < 0 ||
+        (long) idx.cols * idx.rows * idx.block_size * idx.block_size >
+        VPEG_MAX_PIXELS) {
+        job->failed = 1;
+        return;
+    }
+    char header[64];
+    frame_t f;
+    f.width = f.stride = idx.cols * idx.block_size;
+    f.height = idx.rows * idx.block_size;
+    int len = snprintf(header, sizeof(header), "P5 %d %d 255\n", f.width, f.height);
+    job->out.assign(len + (size_t) f.width * f.height, 0);
+    memcpy(job->out.data(), header, len);
+    f.pixels = job->out.data() + len;
+    vpeg_decode_indexed(job->in, idx, f, 1);
+}
+
+static void worker_main(batch_t &b)
+{
+    while (1) {
+        batch_job_t *job;
+        {
+            std::unique_lock<std::mutex> guard(b.lock);
+            b.ready.wait(guard, [&] { return !b.decode_queue.empty(); });
+            job = b.decode_queue.front();
+            b.decode_queue.pop_front();
+        }
+        if (!job)
+            return;
+        decode_job(job);
+        {
+            std::lock_guard<std::mutex> guard(b.lock);
+            b.done_queue.push_back(job);
+        }
+        uint64_t one = 1;
+        if (write(b.efd, &one, sizeof(one)) < 0)
+            perror("eventfd");
+    }
+}
+
+static void fail(batch_t &b, batch_job_t *job, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", b.inputs[job->index], what);
+    job->failed = 1;
+    b.failures++;
+}
+
+// Fallback without io_uring: workers take whole files.
+static void fallback_main(batch_t &b, std::atomic<int> &next)
+{
+    int i;
+    while ((i = next++) < b.count) {
+        batch_job_t job;
+        job.index = i;
+        job.failed = 0;
+        if (read_file(b.inputs[i], job.heap) < 0) {
+            fail(b, &job, strerror(errno));
+            continue;
+        }
+        job.in = job.heap.data();
+        job.in_size = job.heap.size();
+        decode_job(&job);
+        if (job.failed) {
+            fail(b, &job, "malformed stream, or too large");
+            continue;
+        }
+        char path[4096];
+        output_path(b, i, path, sizeof(path));
+        FILE *fp = fopen(path, "wb");
+        if (!fp || fwrite(job.out.data(), job.out.size(), 1, fp) != 1)
+            fail(b, &job, strerror(errno));
+        if (fp)
+            fclose(fp);
+    }
+}
+
+static void queue_read(uring_t &r, batch_job_t *job)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = job->slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = job->fd;
+    sqe->addr = (unsigned long) (job->in + job->in_done);
+    sqe->len = job->in_size - job->in_done;
+    sqe->off = job->in_done;
+    sqe->buf_index = job->slot >= 0 ? job->slot : 0;
+    sqe->user_data = (unsigned long) job;
+}
+
+static void queue_write(uring_t &r, batch_job_t *job)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = job->fd;
+    sqe->addr = (unsigned long) (job->out.data() + job->out_done);
+    sqe->len = job->out.size() - job->out_done;
+    sqe->off = job->out_done;
+    sqe->user_data = (unsigned long) job | 1;
+}
+
+static void queue_wakeup(uring_t &r, batch_t &b)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = b.efd;
+    sqe->addr = (unsigned long) &b.counter;
+    sqe->len = sizeof(b.counter);
+    sqe->user_data = 0;
+}
+
+// iov holds one input buffer per job in flight, registered if fixed.
+static int run_uring(uring_t &r, batch_t &b,
+                     const std::vector<struct iovec> &iov, int fixed)
+{
+    int depth = iov.size();
+    std::vector<int> free_slots;
+    for (int i = 0; i < depth; i++)
+        free_slots.push_back(depth - 1 - i);
+
+    int next = 0, in_flight = 0, finished = 0;
+    queue_wakeup(r, b);
+    while (finished < b.count) {
+        /* Start reading more inputs while there is room. */
+        while (in_flight < depth && next < b.count) {
+            batch_job_t *job = new batch_job_t();
+            job->index = next++;
+            job->fd = open(b.inputs[job->index], O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (job->fd < 0 || fstat(job->fd, &st) < 0) {
+                fail(b, job, strerror(errno));
+                if (job->fd >= 0)
+                    close(job->fd);
+                delete job;
+                finished++;
+                continue;
+            }
+            job->in_size = st.st_size;
+            job->slot = -1;
+            if (fixed && job->in_size <= SLOT_SIZE) {
+                job->slot = free_slots.back();
+                free_slots.pop_back();
+                job->in = (unsigned char *) iov[job->slot].iov_base;
+            } else {
+                job->heap.resize(job->in_size + 1);
+                job->in = job->heap.data();
+            }
+            in_flight++;
+            queue_read(r, job);
+        }
+
+        /* Queue writes for everything the workers have finished. */
+        std::deque<batch_job_t *> done;
+        {
+            std::lock_guard<std::mutex> guard(b.lock);
+            done.swap(b.done_queue);
+        }
+        for (size_t i = 0; i < done.size(); i++) {
+            batch_job_t *job = done[i];
+            if (job->slot >= 0)
+                free_slots.push_back(job->slot);
+            job->slot = -1;
+            char path[4096];
+            output_path(b, job->index, path, sizeof(path));
+            if (job->failed) {
+                fail(b, job, "malformed stream, or too large");
+            } else if ((job->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                       0644)) < 0) {
+                fail(b, job, strerror(errno));
+            } else {
+                queue_write(r, job);
+                continue;
+            }
+            delete job;
+            in_flight--;
+            finished++;
+        }
+        if (finished == b.count)
+            break;
+
+        if (uring_submit(r, 1) < 0 && errno != EINTR) {
+            /* Reads the kernel took may still land in the buffers. The
+               eventfd write completes the wakeup read; without it the
+               caller closes the ring, which cancels the rest. */
+            uint64_t one = 1;
+            if (write(b.efd, &one, sizeof(one)) == sizeof(one))
+                uring_drain(r);
+            return -1;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(r))) {
+            unsigned long data = cqe->user_data;
+            int res = cqe->res;
+            uring_seen(r);
+            if (data == 0) {
+                queue_wakeup(r, b);
+                continue;
+            }
+            batch_job_t *job = (batch_job_t *) (data & ~1UL);
+            if (data & 1) {
+                /* Write finished, or needs another go if it was short. */
+                if (res > 0)
+                    job->out_done += res;
+                if (res > 0 && job->out_done < job->out.size()) {
+                    queue_write(r, job);
+                    continue;
+                }
+                if (res < 0)
+                    fail(b, job, strerror(-res));
+                else if (job->out_done != job->out.size())
+                    fail(b, job, "short write");
+                close(job->fd);
+                delete job;
+                in_flight--;
+                finished++;
+            } else {
+                if (res > 0)
+                    job->in_done += res;
+                if (res > 0 && job->in_done < job->in_size) {
+                    queue_read(r, job);
+                    continue;
+                }
+                close(job->fd);
+                if (res < 0 || job->in_done != job->in_size) {
+                    fail(b, job, res < 0 ? strerror(-res) : "file shrank while read");
+                    if (job->slot >= 0)
+                        free_slots.push_back(job->slot);
+                    delete job;
+                    in_flight--;
+                    finished++;
+                    continue;
+                }
+                std::lock_guard<std::mutex> guard(b.lock);
+                b.decode_queue.push_back(job);
+                b.ready.notify_one();
+            }
+        }
+    }
+    return 0;
+}
+
+int vpeg_batch(char **inputs, int count, const char *outdir, int workers,
+               int depth)
+{
+    batch_t b;
+    b.inputs = inputs;
+    b.count = count;
+    b.outdir = outdir;
+    b.failures = 0;
+    if (workers < 1)
+        workers = 1;
+    if (depth < 1)
+        depth = 1;
+
+    uring_t r;
+    unsigned entries = 1;
+    while (entries < (unsigned) depth + 1)
+        entries <<= 1;
+    b.efd = eventfd(0, EFD_CLOEXEC);
+    int ring = b.efd >= 0 && uring_init(r, entries) == 0;
+    if (ring && (!uring_supports(r, IORING_OP_READ) ||
+                 !uring_supports(r, IORING_OP_WRITE))) {
+        uring_exit(r);
+        ring = 0;
+    }
+    if (!ring) {
+        std::atomic<int> next(0);
+        std::vector<std::thread> pool;
+        for (int i = 0; i < workers; i++)
+            pool.push_back(std::thread(fallback_main, std::ref(b), std::ref(next)));
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+        if (b.efd >= 0)
+            close(b.efd);
+        return b.failures.load();
+    }
+
+    /* Registered buffers for the inputs, one per job in flight. Workers
+       decode straight from them, so they outlive the pool. */
+    std::vector<unsigned char> arena((size_t) depth * SLOT_SIZE);
+    std::vector<struct iovec> iov(depth);
+    for (int i = 0; i < depth; i++) {
+        iov[i].iov_base = arena.data() + (size_t) i * SLOT_SIZE;
+        iov[i].iov_len = SLOT_SIZE;
+    }
+    int fixed = uring_register_buffers(r, iov.data(), depth) == 0;
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < workers; i++)
+        pool.push_back(std::thread(worker_main, std::ref(b)));
+    int ret = run_uring(r, b, iov, fixed);
+    {
+        /* A null job tells a worker to quit. */
+        std::lock_guard<std::mutex> guard(b.lock);
+        for (int i = 0; i < workers; i++)
+            b.decode_queue.push_back(NULL);
+        b.ready.notify_all();
+    }
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+    uring_exit(r);
+    close(b.efd);
+    return ret < 0 ? -1 : b.failures.load();
+}
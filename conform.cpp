@@ -0,0 +1,456 @@
+/*
+ * Differential conformance checks. The oracle is the single-threaded
+ * double-precision decoder, i.e. irle(), dequant() and idct88() as they
+ * produce image.pgm. Every other way of decoding a stream is compared
+ * against it pixel by pixel, then the parsers are fed mutated streams.
+ * Build with make SANITIZE=1 to have the mutated streams checked for
+ * memory errors and undefined behaviour as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vpeg.h"
+#include "async.h"
+
+enum {
+    MODE_THREADS, MODE_CHECKED, MODE_ASYNC, MODE_V2, MODE_TILED, MODE_ENGINE,
+    MODE_FLOAT, MODE_AVX512, MODE_DEBLOCK, MODE_ROWINDEX, MODE_SPECULATE, MODES
+};
+
+static const char *mode_names[MODES] = {
+    "threads", "checked", "async", "v2", "tiled", "engine", "float", "avx512",
+    "deblock", "rowindex", "spec"
+};
+
+// Largest pixel difference each mode may show. Scheduling and parsing
+// changes must be exact, arithmetic ones may round differently, and the
+// deblocking filter moves a pixel by its strongest tc once per edge, and
+// block corners are next to two.
+static const int mode_tolerance[MODES] = { 0, 0, 0, 0, 0, 1, 1, 1, 8, 0, 0 };
+
+// Pictures larger than this are not worth allocating for a mutated stream.
+#define FUZZ_MAX_PIXELS (64 << 20)
+
+static int index_frame(std::vector<unsigned char> &data, stream_index_t &idx,
+                       frame_t &f)
+{
+    if (vpeg_index(data.data(), data.size(), idx) < 0)
+        return -1;
+    long long pixels = (long long) idx.cols * idx.rows * idx.block_size * idx.block_size;
+    if (pixels > FUZZ_MAX_PIXELS)
+        return -1;
+    frame_alloc(f, idx.cols * idx.block_size, idx.rows * idx.block_size);
+    return 0;
+}
+
+static int decode_reference(std::vector<unsigned char> &data, frame_t &f)
+{
+    stream_index_t idx;
+    if (index_frame(data, idx, f) < 0)
+        return -1;
+    int saved = vpeg_transform;
+    vpeg_transform = TRANSFORM_DOUBLE;
+    vpeg_decode_indexed(data.data(), idx, f, 1);
+    vpeg_transform = saved;
+    return 0;
+}
+
+static int decode_async_chunks(std::vector<unsigned char> &data, frame_t &f,
+                               size_t chunk)
+{
+    decode_input_t in;
+    in.eof = 0;
+    decode_task task = vpeg_decode_async(in, f, 0);
+    size_t fed = 0;
+    int state;
+    while ((state = task.resume()) == DECODE_NEED_INPUT || state == DECODE_YIELDED) {
+        if (state == DECODE_YIELDED)
+            continue;
+        size_t n = std::min(chunk, data.size() - fed);
+        in.data.insert(in.data.end(), data.begin() + fed, data.begin() + fed + n);
+        fed += n;
+        in.eof = fed == data.size();
+    }
+    if (state == DECODE_DONE)
+        return 0;
+    frame_free(f);
+    return -1;
+}
+
+// Whether two scans of a stream found the same thing.
+static int same_index(const stream_index_t &a, const stream_index_t &b)
+{
+    return a.rows == b.rows && a.cols == b.cols && a.block_size == b.block_size &&
+           a.trusted == b.trusted && a.blocks == b.blocks && a.end == b.end &&
+           a.row_offset == b.row_offset;
+}
+
+// Largest difference and PSNR between two pictures, -1 if their sizes
+// differ.
+static int compare(const frame_t &a, const frame_t &b, double &psnr)
+{
+    if (a.width != b.width || a.height != b.height)
+        return -1;
+    int worst = 0;
+    double sse = 0;
+    for (int y = 0; y < a.height; y++) {
+        const unsigned char *p = a.pixels + (size_t) y * a.stride;
+        const unsigned char *q = b.pixels + (size_t) y * b.stride;
+        for (int x = 0; x < a.width; x++) {
+            int d = abs(p[x] - q[x]);
+            worst = std::max(worst, d);
+            sse += d * d;
+        }
+    }
+    double mse = a.width && a.height ? sse / ((double) a.width * a.height) : 0;
+    psnr = mse ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+    return worst;
+}
+
+// Decodes data the way mode does. Returns 1 if the mode does not apply to
+// this stream or machine.
+static int decode_mode(std::vector<unsigned char> &data, int mode, frame_t &f)
+{
+    stream_index_t idx;
+    if (mode == MODE_ASYNC)
+        return decode_async_chunks(data, f, 1000);
+    if (mode == MODE_ROWINDEX) {
+        /* Rows found through an index in the stream, not a scan. */
+        std::vector<unsigned char> indexed;
+        if (vpeg_embed_index(data.data(), data.size(), indexed) < 0 ||
+            vpeg_embedded_index(indexed.data(), indexed.size(), idx) < 0)
+            return -1;
+        frame_alloc(f, idx.cols * idx.block_size, idx.rows * idx.block_size);
+        if (vpeg_decode_indexed(indexed.data(), idx, f, 3) == 0)
+            return 0;
+        frame_free(f);
+        return -1;
+    }
+    if (mode == MODE_SPECULATE) {
+        /* Shares of a few dozen bytes, so that small streams split too.
+           The index has to be the one the sequential scan finds. */
+        stream_index_t scanned;
+        if (vpeg_index_speculative(data.data(), data.size(), idx, 5, 48) < 0 ||
+            vpeg_index(data.data(), data.size(), scanned) < 0 ||
+            !same_index(idx, scanned))
+            return -1;
+        frame_alloc(f, idx.cols * idx.block_size, idx.rows * idx.block_size);
+        vpeg_decode_indexed(data.data(), idx, f, 3);
+        return 0;
+    }
+    if (mode == MODE_V2) {
+        std::vector<unsigned char> v2;
+        int cols, rows;
+        if (v1_to_v2(data.data(), data.size(), v2) < 0)
+            return 1;
+        if (v2_geometry(v2.data(), v2.size(), cols, rows) < 0)
+            return -1;
+        frame_alloc(f, cols * 8, rows * 8);
+        return v2_decode(v2.data(), v2.size(), f, 3) < 0 ? -1 : 0;
+    }
+    if (index_frame(data, idx, f) < 0)
+        return -1;
+    int ret = 0;
+    switch (mode) {
+    case MODE_THREADS:
+        vpeg_decode_indexed(data.data(), idx, f, 3);
+        break;
+    case MODE_CHECKED:
+        idx.trusted = 0;
+        vpeg_decode_indexed(data.data(), idx, f, 1);
+        break;
+    case MODE_TILED: {
+        /* Exported in two halves to go through the region code. */
+        tiled_frame_t t;
+        frame_t half = f;
+        tiled_alloc(t, f.width, f.height, idx.block_size);
+        vpeg_decode_tiled(data.data(), idx, t, 3);
+        half.width = std::min(f.width, f.width / 2 + 3);
+        tiled_export(t, 0, 0, half);
+        half.pixels += half.width;
+        half.width = f.width - half.width;
+        tiled_export(t, f.width - half.width, 0, half);
+        tiled_free(t);
+        break;
+    }
+    case MODE_ENGINE:
+        /* The block_engine<8> instantiation on a plain stream. */
+        if (idx.block_size != 8) {
+            ret = 1;
+            break;
+        }
+        for (int row = 0; row < idx.rows; row++)
+            decode_row_n(data.data() + idx.row_offset[row], 8, f, row);
+        break;
+    case MODE_FLOAT:
+    case MODE_AVX512: {
+        int want = mode == MODE_FLOAT ? TRANSFORM_FLOAT : TRANSFORM_AVX512;
+        if (transform_select(want) != want) {
+            ret = 1;
+        } else {
+            vpeg_decode_indexed(data.data(), idx, f, 1);
+        }
+        vpeg_transform = TRANSFORM_DOUBLE;
+        break;
+    }
+    case MODE_DEBLOCK: {
+        /* Raster on three workers and tiled on one must agree exactly,
+           whichever worker ends up filtering a seam. */
+        tiled_frame_t t;
+        frame_t g = f;
+        double psnr;
+        vpeg_deblock = 1;
+        vpeg_decode_indexed(data.data(), idx, f, 3);
+        tiled_alloc(t, f.width, f.height, idx.block_size);
+        vpeg_decode_tiled(data.data(), idx, t, 1);
+        vpeg_deblock = 0;
+        frame_alloc(g, f.width, f.height);
+        tiled_export(t, 0, 0, g);
+        if (compare(f, g, psnr) != 0) {
+            printf("raster and tiled deblocking differ\n");
+            ret = -1;
+        }
+        frame_free(g);
+        tiled_free(t);
+        break;
+    }
+    }
+    if (ret)
+        frame_free(f);
+    return ret;
+}
+
+static int check_modes(conform_input_t &in)
+{
+    frame_t ref;
+    int failures = 0;
+    if (decode_reference(in.data, ref) < 0) {
+        printf("%-24s reference decoder rejects the stream\n", in.name.c_str());
+        return 1;
+    }
+    for (int mode = 0; mode < MODES; mode++) {
+        frame_t f;
+        int ret = decode_mode(in.data, mode, f);
+        if (ret > 0) {
+            printf("%-24s %-8s skipped\n", in.name.c_str(), mode_names[mode]);
+            continue;
+        }
+        double psnr = 0;
+        int worst = ret < 0 ? -1 : compare(ref, f, psnr);
+        int ok = worst >= 0 && worst <= mode_tolerance[mode];
+        if (worst < 0)
+            printf("%-24s %-8s FAIL: %s\n", in.name.c_str(), mode_names[mode],
+                   ret < 0 ? "decode failed" : "size differs");
+        else
+            printf("%-24s %-8s max_err %d psnr %.2f %s\n", in.name.c_str(),
+                   mode_names[mode], worst, psnr, ok ? "ok" : "FAIL");
+        failures += !ok;
+        if (ret == 0)
+            frame_free(f);
+    }
+    frame_free(ref);
+    return failures;
+}
+
+static unsigned long long fuzz_state;
+
+static unsigned fuzz_rand(void)
+{
+    fuzz_state ^= fuzz_state >> 12;
+    fuzz_state ^= fuzz_state << 25;
+    fuzz_state ^= fuzz_state >> 27;
+    return (fuzz_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// One to four random edits, biased towards the bytes that steer the parser.
+static void mutate(std::vector<unsigned char> &s)
+{
+    static const unsigned char tokens[] = {
+        0xa0, 0xa3, 0xac, 0xad, 0xae, 0xaf, 0xff, 0x9e, 0x80, 0x3f, 0x00
+    };
+    for (int edits = 1 + fuzz_rand() % 4; edits > 0 && !s.empty(); edits--) {
+        size_t at = fuzz_rand() % s.size();
+        switch (fuzz_rand() % 6) {
+        case 0:
+            s[at] ^= 1 << (fuzz_rand() % 8);
+            break;
+        case 1:
+            s[at] = tokens[fuzz_rand() % sizeof(tokens)];
+            break;
+        case 2:
+            s[at] = fuzz_rand();
+            break;
+        case 3:
+            s.resize(at);
+            break;
+        case 4: {
+            size_t len = std::min<size_t>(1 + fuzz_rand() % 32, s.size() - at);
+            std::vector<unsigned char> copy(s.begin() + at, s.begin() + at + len);
+            s.insert(s.begin() + fuzz_rand() % s.size(), copy.begin(), copy.end());
+            break;
+        }
+        case 5:
+            s.erase(s.begin() + at,
+                    s.begin() + std::min<size_t>(s.size(), at + 1 + fuzz_rand() % 32));
+            break;
+        }
+    }
+}
+
+// Runs a mutated stream through every parser. Nothing may crash, a stream
+// that validates as trusted must decode the same through the unchecked and
+// the checked decoder, and any stream the same into tiles. The speculative
+// scan has to agree with the sequential one on every stream. Returns the
+// number of mismatches.
+static int fuzz_one(std::vector<unsigned char> &s, int &accepted)
+{
+    int failures = 0;
+    stream_index_t idx, spec;
+    frame_t f, g;
+    int scanned = vpeg_index(s.data(), s.size(), idx);
+    if (vpeg_index_speculative(s.data(), s.size(), spec, 2 + fuzz_rand() % 6,
+                               1 + fuzz_rand() % 64) != scanned ||
+        (scanned == 0 && !same_index(idx, spec)))
+        failures++;
+    if (index_frame(s, idx, f) == 0) {
+        double psnr;
+        accepted++;
+        vpeg_decode_indexed(s.data(), idx, f, 1);
+        if (idx.trusted) {
+            frame_alloc(g, f.width, f.height);
+            idx.trusted = 0;
+            vpeg_decode_indexed(s.data(), idx, g, 1);
+            idx.trusted = 1;
+            failures += compare(f, g, psnr) != 0;
+            frame_free(g);
+        }
+        tiled_frame_t t;
+        tiled_alloc(t, f.width, f.height, idx.block_size);
+        vpeg_decode_tiled(s.data(), idx, t, 1);
+        frame_alloc(g, f.width, f.height);
+        tiled_export(t, 0, 0, g);
+        failures += compare(f, g, psnr) != 0;
+        tiled_free(t);
+        /* Deblocking only has to survive whatever the decoder accepts. */
+        vpeg_deblock = 1;
+        vpeg_decode_indexed(s.data(), idx, g, 2);
+        vpeg_deblock = 0;
+        frame_free(g);
+        frame_free(f);
+    }
+
+    /* An embedded index that was damaged after it was written. */
+    std::vector<unsigned char> e;
+    if (vpeg_embed_index(s.data(), s.size(), e) == 0) {
+        mutate(e);
+        if (vpeg_embedded_index(e.data(), e.size(), idx) == 0 &&
+            (long long) idx.cols * idx.rows * idx.block_size * idx.block_size <=
+            FUZZ_MAX_PIXELS) {
+            frame_alloc(f, idx.cols * idx.block_size, idx.rows * idx.block_size);
+            vpeg_decode_indexed(e.data(), idx, f, 2);
+            frame_free(f);
+        }
+    }
+
+    std::vector<unsigned char> v2, v1;
+    if (v1_to_v2(s.data(), s.size(), v2) == 0)
+        v2_to_v1(v2.data(), v2.size(), v1);
+    coef_picture_t p;
+    parse_coefficients(s.data(), s.size(), p);
+    if (decode_async_chunks(s, f, 1 + fuzz_rand() % 512) == 0)
+        frame_free(f);
+
+    /* And the v2 reader on mutated v2 streams. */
+    if (!v2.empty()) {
+        mutate(v2);
+        int cols, rows;
+        if (v2_geometry(v2.data(), v2.size(), cols, rows) == 0 &&
+            (long long) cols * rows * 64 <= FUZZ_MAX_PIXELS) {
+            frame_alloc(f, cols * 8, rows * 8);
+            v2_decode(v2.data(), v2.size(), f, 1);
+            frame_free(f);
+            v2_to_v1(v2.data(), v2.size(), v1);
+        }
+    }
+    return failures;
+}
+
+static void add_input(std::vector<conform_input_t> &inputs, const char *name,
+                      const std::vector<unsigned char> &data)
+{
+    conform_input_t in;
+    in.name = name;
+    in.data = data;
+    inputs.push_back(in);
+}
+
+// Streams generated here: token-level synthetic ones that stress the
+// parser, and encoded pictures at every block size.
+static void generated_corpus(std::vector<conform_input_t> &inputs)
+{
+    static const struct { int size; double density, run, skips, dups; int seed; } synth[] = {
+        { 64, 2, 0.5, 0.2, 0.3, 11 },
+        { 136, 12, 1.5, 0.01, 0.05, 12 },
+        { 256, 40, 0.3, 0.0, 0.0, 13 },
+        { 72, 63, 0, 0.05, 0.0, 14 },
+    };
+    for (size_t i = 0; i < sizeof(synth) / sizeof(synth[0]); i++) {
+        synth_params_t p;
+        synth_defaults(p);
+        p.width = p.height = synth[i].size;
+        p.density = synth[i].density;
+        p.run_length = synth[i].run;
+        p.skip_rate = synth[i].skips;
+        p.dup_ratio = synth[i].dups;
+        p.seed = synth[i].seed;
+        std::vector<unsigned char> s;
+        synth_stream(p, s);
+        char name[64];
+        snprintf(name, sizeof(name), "synth-%d-%g", synth[i].size, synth[i].density);
+        add_input(inputs, name, s);
+    }
+
+    frame_t pic;
+    frame_alloc(pic, 100, 68);
+    for (int y = 0; y < pic.height; y++)
+        for (int x = 0; x < pic.width; x++)
+            pic.pixels[y * pic.stride + x] =
+                (x * 2 + y) ^ ((x / 9 + y / 7) & 1 ? 0x55 : 0) ^ (x * y % 13);
+    static const int sizes[] = { 4, 8, 16 };
+    for (int q = 0; q < 4; q++)
+        for (int i = 0; i < 3; i++) {
+            std::vector<unsigned char> s;
+            vpeg_encode(pic, q, 1, s, sizes[i]);
+            char name[64];
+            snprintf(name, sizeof(name), "encoded-q%d-b%d", q, sizes[i]);
+            add_input(inputs, name, s);
+        }
+    frame_free(pic);
+}
+
+int vpeg_conform(std::vector<conform_input_t> &inputs, int fuzz_iterations,
+                 unsigned long seed)
+{
+    generated_corpus(inputs);
+    int failures = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+        failures += check_modes(inputs[i]);
+
+    fuzz_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    int runs = 0, accepted = 0, mismatches = 0;
+    for (int it = 0; it < fuzz_iterations; it++) {
+        std::vector<unsigned char> s = inputs[it % inputs.size()].data;
+        mutate(s);
+        mismatches += fuzz_one(s, accepted);
+        runs++;
+    }
+    printf("fuzz: %d mutated streams, %d accepted, %d decoded differently "
+           "through the checked decoder or into tiles, or scanned differently "
+           "in parallel\n", runs, accepted, mismatches);
+    failures += mismatches;
+    printf("%s: %d failure(s)\n", failures ? "FAIL" : "PASS", failures);
+    return failures;
+}
@@ -0,0 +1,239 @@
+/*
+ * In-loop deblocking. Each row of blocks is filtered right after it is
+ * decoded, while its pixels are still in cache, instead of in a pass over
+ * the finished picture.
+ *
+ * The filter is the H.264 normal-strength edge filter reduced to its
+ * simplest form: across an edge p1 p0 | q0 q1, a step |p0 - q0| smaller
+ * than alpha between sides flatter than beta is taken for a blocking
+ * artefact, and p0 and q0 move towards each other by at most tc. The
+ * thresholds grow with the quantization level of the blocks on either
+ * side, level 0 is left alone.
+ *
+ * Vertical edges inside a row are filtered by whoever decoded the row.
+ * The horizontal seam between two rows needs both rows decoded and their
+ * vertical edges done; with several workers, the second of the two to
+ * finish filters it. Since only p0 and q0 change, the seams above and
+ * below a row read and write different lines of it, and the result does
+ * not depend on the order rows finish in.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "vpeg.h"
+
+static const unsigned char deblock_alpha[4] = { 0, 4, 8, 16 };
+static const unsigned char deblock_beta[4] = { 0, 2, 4, 8 };
+static const unsigned char deblock_tc[4] = { 0, 1, 2, 4 };
+
+int vpeg_deblock = 0;
+
+// The edge filter on one pixel pair. Used for what is left over after the
+// vector code and on machines without AVX2.
+static inline void filter_pixel(int a, unsigned char &p0, unsigned char &q0,
+                                int d, int alpha, int beta, int t)
+{
+    int b = p0, c = q0;
+    if (abs(b - c) >= alpha || abs(a - b) >= beta || abs(d - c) >= beta)
+        return;
+    int delta = ((c - b) * 4 + (a - d) + 4) >> 3;
+    delta = delta < -t ? -t : (delta > t ? t : delta);
+    b += delta;
+    c -= delta;
+    p0 = b < 0 ? 0 : (b > 255 ? 255 : b);
+    q0 = c < 0 ? 0 : (c > 255 ? 255 : c);
+}
+
+// filter_pixel() on 16 pixels at a time, in 16-bit lanes. Returns how many
+// it did, a multiple of 16.
+__attribute__((target("avx2")))
+static int filter_edges_avx2(const unsigned char *p1, unsigned char *p0,
+                             unsigned char *q0, const unsigned char *q1,
+                             const unsigned char *alpha,
+                             const unsigned char *beta,
+                             const unsigned char *tc, int count)
+{
+#define LOAD16(p) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (p)))
+    const __m256i four = _mm256_set1_epi16(4);
+    int i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m256i a = LOAD16(p1 + i), b = LOAD16(p0 + i), c = LOAD16(q0 + i),
+                d = LOAD16(q1 + i), t = LOAD16(tc + i);
+        __m256i delta = _mm256_add_epi16(_mm256_slli_epi16(_mm256_sub_epi16(c, b), 2),
+                                         _mm256_sub_epi16(a, d));
+        delta = _mm256_srai_epi16(_mm256_add_epi16(delta, four), 3);
+        delta = _mm256_min_epi16(_mm256_max_epi16(delta, _mm256_sub_epi16(_mm256_setzero_si256(), t)), t);
+        __m256i flat = _mm256_and_si256(
+            _mm256_cmpgt_epi16(LOAD16(alpha + i), _mm256_abs_epi16(_mm256_sub_epi16(b, c))),
+            _mm256_and_si256(
+                _mm256_cmpgt_epi16(LOAD16(beta + i), _mm256_abs_epi16(_mm256_sub_epi16(a, b))),
+                _mm256_cmpgt_epi16(LOAD16(beta + i), _mm256_abs_epi16(_mm256_sub_epi16(d, c)))));
+        delta = _mm256_and_si256(delta, flat);
+        /* packus works within 128-bit lanes, the permute puts the two
+           halves of the result next to each other. */
+        __m256i pb = _mm256_packus_epi16(_mm256_add_epi16(b, delta), _mm256_setzero_si256());
+        __m256i pc = _mm256_packus_epi16(_mm256_sub_epi16(c, delta), _mm256_setzero_si256());
+        _mm_storeu_si128((__m128i *) (p0 + i),
+                         _mm256_castsi256_si128(_mm256_permute4x64_epi64(pb, 0xd8)));
+        _mm_storeu_si128((__m128i *) (q0 + i),
+                         _mm256_castsi256_si128(_mm256_permute4x64_epi64(pc, 0xd8)));
+    }
+#undef LOAD16
+    return i;
+}
+
+// Filters count edges at once, pixel i of each side at p1[i] ... q1[i].
+static void filter_edges(const unsigned char *p1, unsigned char *p0,
+                         unsigned char *q0, const unsigned char *q1,
+                         const unsigned char *alpha, const unsigned char *beta,
+                         const unsigned char *tc, int count)
+{
+    int i = 0;
+    if (count >= 16 && __builtin_cpu_supports("avx2"))
+        i = filter_edges_avx2(p1, p0, q0, q1, alpha, beta, tc, count);
+    for (; i < count; i++)
+        filter_pixel(p1[i], p0[i], q0[i], q1[i], alpha[i], beta[i], tc[i]);
+}
+
+// Pixel (x, y) of block (row, col), raster or tiled.
+static inline unsigned char *block_pixel(const deblock_t &d, int row, int col,
+                                         int x, int y)
+{
+    int n = d.block_size;
+    if (d.tiled)
+        return d.pixels + ((size_t) row * d.cols + col) * n * n + y * n + x;
+    return d.pixels + ((size_t) row * n + y) * d.stride + col * n + x;
+}
+
+// Thresholds for the edge between blocks with levels l and m as stored in
+// quant, 0 for a missing block, which turns filtering off.
+static void thresholds(unsigned char l, unsigned char m, unsigned char &alpha,
+                       unsigned char &beta, unsigned char &tc)
+{
+    int level = l && m ? (l > m ? l : m) - 1 : 0;
+    alpha = deblock_alpha[level];
+    beta = deblock_beta[level];
+    tc = deblock_tc[level];
+}
+
+// Vertical edges inside row, gathered into lines so that they go through
+// filter_edges() as one batch.
+static void filter_row(deblock_t &d, int row)
+{
+    int n = d.block_size, count = (d.cols - 1) * n;
+    if (count <= 0)
+        return;
+    std::vector<unsigned char> buf(7 * count);
+    unsigned char *p1 = buf.data(), *p0 = p1 + count, *q0 = p0 + count,
+                  *q1 = q0 + count, *alpha = q1 + count, *beta = alpha + count,
+                  *tc = beta + count;
+    const unsigned char *quant = d.quant.data() + (size_t) row * d.cols;
+    for (int e = 1; e < d.cols; e++) {
+        unsigned char a, b, t;
+        thresholds(quant[e - 1], quant[e], a, b, t);
+        for (int y = 0; y < n; y++) {
+            int i = (e - 1) * n + y;
+            const unsigned char *left = block_pixel(d, row, e - 1, n - 2, y);
+            const unsigned char *right = block_pixel(d, row, e, 0, y);
+            p1[i] = left[0];
+            p0[i] = left[1];
+            q0[i] = right[0];
+            q1[i] = right[1];
+            alpha[i] = a;
+            beta[i] = b;
+            tc[i] = t;
+        }
+    }
+    filter_edges(p1, p0, q0, q1, alpha, beta, tc, count);
+    for (int e = 1; e < d.cols; e++)
+        for (int y = 0; y < n; y++) {
+            int i = (e - 1) * n + y;
+            *block_pixel(d, row, e - 1, n - 1, y) = p0[i];
+            *block_pixel(d, row, e, 0, y) = q0[i];
+        }
+}
+
+// The seam between row - 1 and row. In a raster plane its four lines are
+// contiguous across the whole width; in a tiled one they are gathered from
+// the tiles first, like the vertical edges.
+static void filter_seam(deblock_t &d, int row)
+{
+    int n = d.block_size, width = d.cols * n;
+    std::vector<unsigned char> buf(7 * width);
+    unsigned char *alpha = buf.data(), *beta = alpha + width, *tc = beta + width;
+    const unsigned char *above = d.quant.data() + (size_t) (row - 1) * d.cols;
+    const unsigned char *below = above + d.cols;
+    for (int col = 0; col < d.cols; col++) {
+        unsigned char a, b, t;
+        thresholds(above[col], below[col], a, b, t);
+        memset(alpha + col * n, a, n);
+        memset(beta + col * n, b, n);
+        memset(tc + col * n, t, n);
+    }
+    unsigned char *line[4];
+    for (int k = 0; k < 2; k++) {
+        line[k] = block_pixel(d, row - 1, 0, 0, n - 2 + k);
+        line[k + 2] = block_pixel(d, row, 0, 0, k);
+    }
+    if (d.tiled) {
+        /* Tiles are n * n bytes apart along a line. */
+        unsigned char *gathered = tc + width;
+        for (int k = 0; k < 4; k++)
+            for (int col = 0; col < d.cols; col++)
+                memcpy(gathered + k * width + col * n,
+                       line[k] + (size_t) col * n * n, n);
+        filter_edges(gathered, gathered + width, gathered + 2 * width,
+                     gathered + 3 * width, alpha, beta, tc, width);
+        for (int k = 1; k < 3; k++)
+            for (int col = 0; col < d.cols; col++)
+                memcpy(line[k] + (size_t) col * n * n,
+                       gathered + k * width + col * n, n);
+    } else {
+        filter_edges(line[0], line[1], line[2], line[3], alpha, beta, tc, width);
+    }
+}
+
+void deblock_init(deblock_t &d, frame_t &f, int block_size)
+{
+    d.block_size = block_size;
+    d.cols = f.width / block_size;
+    d.rows = f.height / block_size;
+    d.pixels = f.pixels;
+    d.stride = f.stride;
+    d.tiled = 0;
+    d.quant.assign((size_t) d.cols * d.rows, 0);
+    d.ready = std::vector<std::atomic<int> >(d.rows + 1);
+}
+
+void deblock_init_tiled(deblock_t &d, tiled_frame_t &t)
+{
+    d.block_size = t.block_size;
+    d.cols = t.cols;
+    d.rows = t.rows;
+    d.pixels = t.tiles;
+    d.stride = 0;
+    d.tiled = 1;
+    d.quant.assign((size_t) d.cols * d.rows, 0);
+    d.ready = std::vector<std::atomic<int> >(d.rows + 1);
+}
+
+unsigned char *deblock_quant(deblock_t &d, int row)
+{
+    return row < d.rows ? d.quant.data() + (size_t) row * d.cols : NULL;
+}
+
+void deblock_row(deblock_t &d, int row)
+{
+    if (row >= d.rows)
+        return;
+    PROF_START();
+    filter_row(d, row);
+    /* ready[s] counts the finished rows of the two around seam s. */
+    if (row > 0 && d.ready[row].fetch_add(1) == 1)
+        filter_seam(d, row);
+    if (row + 1 < d.rows && d.ready[row + 1].fetch_add(1) == 1)
+        filter_seam(d, row + 1);
+    PROF_STAGE(PROF_DEBLOCK);
+}
@@ -86,9 +86,16 @@ Hints
 *******************************************************************************/
 
 #include <stdio.h>
-#include <math.h>
+#include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
+
+#include "vpeg.h"
+#include "async.h"
 
 unsigned char data[] = 
     {
@@ -366,228 +373,331 @@ unsigned char data[] =
         0x00, 0x9e, 0x00, 0x9e, 0x00, 0xac, 0xae, 0xaf, 
     };
 
-// "Large enough." Promise you won't tell your lecturers.
-unsigned char pic[320][320];
-
-typedef double block_t[8][8];
-typedef short quant_block_t[8][8];
+static void usage(void)
+{
+    fprintf(stderr, "usage: decompressor [-j threads] [input.vpeg [output.pgm]]\n"
+                    "       decompressor -m [input.vpeg]\n"
+                    "       decompressor -s input.vpeg [frame%%04d.pgm]\n"
+                    "       decompressor [-j workers] --serve socket\n"
+                    "       decompressor [-j workers] [-d depth] -b outdir input.vpeg...\n"
+                    "       decompressor --async [--slice ms] input.vpeg [output.pgm]\n"
+                    "       decompressor --conform [--fuzz n] [input.vpeg...]\n"
+                    "  -t double|float|avx512  inverse transform, if it passes the\n"
+                    "                          self-check (double)\n"
+                    "  -D                      smooth block edges as rows are decoded\n");
+    exit(1);
+}
 
-/*
- * Missing function -- part of problem;
- *
- * author: Victor Zamanian <victor.zamanian@gmail.com>
- */
-void transpose(block_t &m)
+// One line per skip record: offset, block position, length and payload
+// with anything unprintable escaped.
+static void print_skips(const unsigned char *bitstream,
+                        const std::vector<skip_record_t> &skips)
 {
-    /* Increase horizontal initial index for each row. */
-    int limit = 0;
-    double temp;
-    for (int i = 0; i < 8; i++) {
-        for (int j = limit++; j < 8; j++) {
-          /* Swap m[i][j] and m[j][i]. */
-          temp = m[i][j];
-          m[i][j] = m[j][i];
-          m[j][i] = temp;
+    for (size_t i = 0; i < skips.size(); i++) {
+        const skip_record_t &r = skips[i];
+        printf("%zu %d %d %d ", r.offset, r.row, r.col, r.len);
+        const unsigned char *payload = bitstream + r.offset + 2;
+        for (int j = 0; j < r.len; j++) {
+            if (payload[j] >= 0x20 && payload[j] < 0x7f && payload[j] != '\\')
+                putchar(payload[j]);
+            else
+                printf("\\x%02x", payload[j]);
         }
+        putchar('\n');
     }
 }
 
-// Quantifization matrices: (divided by 8)
-// value=0:
-//    x 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-//    1 1 1 1 1 1 1 1
-// value=1:
-//    x 1 1 1 2 2 2 2
-//    1 1 1 1 2 2 2 2
-//    1 1 1 1 2 2 2 2
-//    1 1 1 1 2 2 2 2
-//    2 2 2 2 4 4 4 4
-//    2 2 2 2 4 4 4 4
-//    2 2 2 2 4 4 4 4
-//    2 2 2 2 4 4 4 4
-// value=2:
-//    x 2 2 2  4  4  4  4
-//    2 2 2 2  4  4  4  4
-//    2 2 2 2  4  4  4  4
-//    2 2 2 2  4  4  4  4
-//    4 4 4 4 16 16 16 16
-//    4 4 4 4 16 16 16 16
-//    4 4 4 4 16 16 16 16
-//    4 4 4 4 16 16 16 16
-//    4 4 4 4 16 16 16 16
-// value=3:
-//    x 4 4 4  8  8  8  8
-//    4 4 4 4  8  8  8  8
-//    4 4 4 4  8  8  8  8
-//    4 4 4 4  8  8  8  8
-//    8 8 8 8 64 64 64 64
-//    8 8 8 8 64 64 64 64
-//    8 8 8 8 64 64 64 64
-//    8 8 8 8 64 64 64 64
-
-int quant_values[4][3] = { { 1, 1, 1 },
-                           { 1, 2, 4 },
-                           { 2, 4, 16 },
-                           { 4, 8, 64 } };
-
-// Inverse quantization
-void dequant(block_t &m, quant_block_t &qm, int value)
+// Writes every frame of a sequence, output being a printf pattern for the
+// frame number.
+static int decode_sequence(unsigned char *bitstream, size_t len,
+                           const char *output)
 {
-    for (int y = 0; y < 8; y++)
-        for (int x = 0; x < 8; x++)
-            m[y][x] = qm[y][x] * quant_values[value][(y>4) + (x>4)] * 8;
-    m[0][0] = 16384;
+    seq_decoder_t s;
+    const unsigned char *end = bitstream + len;
+    if (seq_decoder_init(s, bitstream, len) < 0) {
+        fprintf(stderr, "Not a sequence, or too large to decode.\n");
+        return 1;
+    }
+    int ret;
+    while ((ret = seq_decode_frame(s, bitstream, end)) > 0) {
+        char path[4096];
+        snprintf(path, sizeof(path), output, s.frames - 1);
+        printf("Frame %d: %zu of %d blocks changed.\n", s.frames - 1,
+               s.dirty.size(), s.cols * s.rows);
+        if (write_pgm(path, s.frame) < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+    frame_free(s.frame);
+    if (ret < 0) {
+        fprintf(stderr, "Frame %d is malformed.\n", s.frames);
+        return 1;
+    }
+    return 0;
 }
 
-// Inverse DCT of length 8
-void idct(double *x)
+static int decode_v2(const unsigned char *bitstream, size_t len,
+                     const char *output, int threads)
 {
-    double sum[8];
-    for (int k = 0; k < 8; k++) {
-        sum[k] = (1/2.0) * x[0];
-        for (int n = 1; n < 8; n++)
-            sum[k] += x[n] * cos(M_PI / 8 * n * (k + 0.5));
+    int cols, rows;
+    frame_t pic;
+    if (v2_geometry(bitstream, len, cols, rows) < 0) {
+        fprintf(stderr, "Malformed stream.\n");
+        return 1;
+    }
+    if ((long) cols * rows * 64 > VPEG_MAX_PIXELS ||
+        frame_alloc(pic, cols * 8, rows * 8) < 0) {
+        fprintf(stderr, "Picture too large to decode.\n");
+        return 1;
+    }
+    int ret = 0;
+    if (v2_decode(bitstream, len, pic, threads) < 0) {
+        fprintf(stderr, "Malformed stream.\n");
+        ret = 1;
+    } else if (write_pgm(output, pic) < 0) {
+        perror(output);
+        ret = 1;
     }
-    for (int k = 0; k < 8; k++)
-        x[k] = sum[k] * (2/8.0);
+    frame_free(pic);
+    return ret;
 }
 
-// Inverse 8-by-8 DCT
-void idct88(block_t &m)
+// Feeds the coroutine decoder from a poll() loop, the way an event loop
+// would: bytes are read only when it asks for them, a few KiB at a time.
+static int decode_async(const char *input, const char *output, double slice)
 {
-    for (int i = 0; i < 8; i++)
-        idct(m[i]);
-    transpose(m);
-    for (int i = 0; i < 8; i++)
-        idct(m[i]);
+    int fd = open(input, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(input);
+        return 1;
+    }
+    decode_input_t in;
+    in.eof = 0;
+    frame_t pic;
+    decode_task task = vpeg_decode_async(in, pic, slice);
+    int state, waits = 0, yields = 0;
+    while ((state = task.resume()) == DECODE_NEED_INPUT ||
+           state == DECODE_YIELDED) {
+        if (state == DECODE_YIELDED) {
+            /* Other requests would get their turn here. */
+            yields++;
+            continue;
+        }
+        waits++;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0)
+            break;
+        unsigned char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n > 0)
+            in.data.insert(in.data.end(), chunk, chunk + n);
+        else
+            in.eof = 1;
+    }
+    close(fd);
+    if (state != DECODE_DONE) {
+        fprintf(stderr, "Malformed stream, or too large.\n");
+        frame_free(pic);
+        return 1;
+    }
+    printf("Decoded %dx%d, waited for input %d times, yielded %d times.\n",
+           pic.width, pic.height, waits, yields);
+    if (write_pgm(output, pic) < 0) {
+        perror(output);
+        return 1;
+    }
+    frame_free(pic);
+    return 0;
 }
 
-int zigzag_order[64] = { 
-     0,  2,  5,  9, 14, 20, 27, 35,  
-     1,  4,  8, 13, 19, 26, 34, 42,
-     3,  7, 12, 18, 25, 33, 41, 48,
-     6, 11, 17, 24, 32, 40, 47, 53,
-    10, 16, 23, 31, 39, 46, 52, 57,
-    15, 22, 30, 38, 45, 51, 56, 60,
-    21, 29, 37, 44, 50, 55, 59, 62,
-    28, 36, 43, 49, 54, 58, 61, 63 };
-
-// Inverse zig-zag reshuffling
-void izigzag(quant_block_t &in, quant_block_t &out)
+// Fails past VPEG_MAX_PIXELS or when there is no memory for the picture.
+static int alloc_picture(tiled_frame_t &pic, const stream_index_t &idx,
+                         int embedded_image)
 {
-    for (int i = 0; i < 64; i++)
-        out[0][i] = in[0][zigzag_order[i]];
+    // "Large enough." Promise you won't tell your lecturers.
+    if (embedded_image)
+        return tiled_alloc(pic, 320, 320, idx.block_size);
+    if ((long) idx.cols * idx.rows * idx.block_size * idx.block_size >
+        VPEG_MAX_PIXELS)
+        return -1;
+    return tiled_alloc(pic, idx.cols * idx.block_size,
+                       idx.rows * idx.block_size, idx.block_size);
 }
 
-#define CHECKSKIP while (((unsigned char) bitstream[0]) == 0xff) bitstream += bitstream[1] + 2;
-
-// Inverse run-length encoding. 
-// TODO: error checking
-int irle(quant_block_t &bl, signed char *&bitstream)
+int main(int argc, char **argv)
 {
-    /* Value to be returned. */
-    int quantval;
-    /* Initialize bl with zeros? */
-    memset(bl, 0, sizeof(bl));
-    /* Set m to point to bl[0] */
-    short *m = bl[0];
-    /* Skip bytes to be skipped. */
-    CHECKSKIP;
-    /* Assert that we are at the beginning of a block. */
-    assert((bitstream[0] & 0xac) == 0xa0);
-    /* Set quantval to be 0, 1, 2 or 3, depending on bitstream[0]. */
-    quantval = bitstream[0] & 0x03;
-    /* Combine the next two bytes into a short and store it. */
-    *(m++) = (bitstream[1] << 8) | (bitstream[2]);
-    /* Go to the next value. */
-    bitstream += 3;
-    while (1) {
-        /* Skip bytes to be skipped. */
-        CHECKSKIP;
-        /* If at end of block. */
-        if (((unsigned char) *bitstream) == 0xac) {
-            /* Go to the next value. */
-            bitstream++;
-            /* Return the quantization value. */
-            return quantval;
-        /* If bitstream points to a coefficient value. */
-        } else if (!(*bitstream & 0x80)) {
-            /* Fetch the xxxxxx part of the sxxxxxx in the coefficient
-               value. */
-            /* Then fetch the s part of the sxxxxxx in the coefficient
-               value. */
-            *(m++) = (*bitstream & 0x3f) * ((*bitstream & 0x40) ? -1 : 1);
-            bitstream++;
-        /* If we've bumped into a 0b100zzzzs byte. */
-        } else if ((*bitstream & 0xe0) == 0x80) {
-            /* Skip 0b0000zzzz byte (keep them as zeroes). */
-            m += (*bitstream & 0x1e) >> 1;
-            /* Fetch the next coefficient value and multiply with `s'
-               from 0b100zzzzs. */
-            *(m++) = bitstream[1] * (bitstream[0] & 0x1 ? -1 : 1);
-            /* Move to the next bitstream byte code. */
-            bitstream += 2;
+    static const struct option long_options[] = {
+        { "serve", required_argument, NULL, 'S' },
+        { "async", no_argument, NULL, 'A' },
+        { "slice", required_argument, NULL, 'L' },
+        { "conform", no_argument, NULL, 'C' },
+        { "fuzz", required_argument, NULL, 'F' },
+        { NULL, 0, NULL, 0 }
+    };
+    int threads = 1, metadata = 0, sequence = 0, depth = 256, transform = 0, opt;
+    const char *serve = NULL, *batch = NULL;
+    int async = 0, conform = 0, fuzz = 20000;
+    double slice = 2e-3;
+    while ((opt = getopt_long(argc, argv, "j:msb:d:t:D", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            metadata = 1;
+            break;
+        case 's':
+            sequence = 1;
+            break;
+        case 'S':
+            serve = optarg;
+            break;
+        case 'A':
+            async = 1;
+            break;
+        case 'L':
+            slice = atof(optarg) * 1e-3;
+            break;
+        case 'C':
+            conform = 1;
+            break;
+        case 'F':
+            fuzz = atoi(optarg);
+            break;
+        case 'b':
+            batch = optarg;
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'D':
+            vpeg_deblock = 1;
+            break;
+        case 't':
+            while (strcmp(optarg, transform_name(transform)))
+                if (++transform > TRANSFORM_AVX512)
+                    usage();
+            break;
+        default:
+            usage();
         }
     }
-}
+    if (transform && transform_select(transform) != transform)
+        fprintf(stderr, "Using the %s transform.\n",
+                transform_name(vpeg_transform));
+    if (batch) {
+        int failed = vpeg_batch(argv + optind, argc - optind, batch, threads,
+                                depth);
+        if (failed)
+            fprintf(stderr, "%d of %d files failed.\n",
+                    failed < 0 ? argc - optind : failed, argc - optind);
+        return failed != 0;
+    }
+    if (conform) {
+        /* The embedded picture first, then whatever else is given. */
+        std::vector<conform_input_t> inputs(1);
+        inputs[0].name = "embedded";
+        inputs[0].data.assign(data, data + sizeof(data));
+        for (int i = optind; i < argc; i++) {
+            conform_input_t in;
+            in.name = argv[i];
+            if (read_file(argv[i], in.data) < 0) {
+                perror(argv[i]);
+                return 1;
+            }
+            inputs.push_back(in);
+        }
+        return vpeg_conform(inputs, fuzz, 1) != 0;
+    }
+    if (argc - optind > (metadata ? 1 : 2))
+        usage();
+    if (async) {
+        if (optind >= argc)
+            usage();
+        return decode_async(argv[optind],
+                            optind + 1 < argc ? argv[optind + 1] : "image.pgm",
+                            slice);
+    }
+    if (serve) {
+        vpeg_serve(serve, threads);
+        perror(serve);
+        return 1;
+    }
 
-int main(void)
-{
-    int row = 0, col = 0;
+    /* Without arguments, decode the embedded image. */
+    std::vector<unsigned char> input;
     unsigned char *bitstream = data;
+    size_t len = sizeof(data);
+    if (optind < argc) {
+        if (read_file(argv[optind], input) < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+        bitstream = input.data();
+        len = input.size();
+    }
+    if (sequence)
+        return decode_sequence(bitstream, len,
+                               optind + 1 < argc ? argv[optind + 1] : "frame%04d.pgm");
+    const char *output = optind + 1 < argc ? argv[optind + 1] : "image.pgm";
+
+    if (is_v2(bitstream, len)) {
+        if (!metadata)
+            return decode_v2(bitstream, len, output, threads);
+        /* Skip records are only listed from v1 streams. */
+        std::vector<unsigned char> v1;
+        if (v2_to_v1(bitstream, len, v1) < 0) {
+            fprintf(stderr, "Malformed stream.\n");
+            return 1;
+        }
+        input.swap(v1);
+        bitstream = input.data();
+        len = input.size();
+    }
 
-    memset(pic, 0, sizeof(pic));
+    stream_index_t idx;
+    std::vector<skip_record_t> skips;
+    /* With a row index of its own, the stream is decoded without a scan,
+       otherwise the scan is split between the decoding threads. */
+    int embedded = !metadata && vpeg_embedded_index(bitstream, len, idx) == 0;
+    if (!embedded && (metadata ? vpeg_index(bitstream, len, idx, &skips)
+                               : vpeg_index_speculative(bitstream, len, idx, threads)) < 0) {
+        fprintf(stderr, "Malformed stream.\n");
+        return 1;
+    }
+    if (metadata) {
+        print_skips(bitstream, skips);
+        return 0;
+    }
 
-    // TODO: error checking
-    while (1) {
-        /* Skip bytes to be skipped. */
-        CHECKSKIP;
-        /* If *bitstream points to EOF. */
-        if (*bitstream == 0xaf) {
-            printf("Reached EOF.\n");
-            break;
-        /* If *bitstream points to a [next row of blocks]. */
-        } else if (*bitstream == 0xae) {
-            printf("Next row of blocks...\n");
-            bitstream++;
-            row++;
-            col = 0;
-            continue;
+    tiled_frame_t pic;
+    if (alloc_picture(pic, idx, bitstream == data) < 0) {
+        fprintf(stderr, "Picture too large to decode.\n");
+        return 1;
+    }
+    if (vpeg_decode_tiled(bitstream, idx, pic, threads)) {
+        fprintf(stderr, "Embedded row index does not match the stream, "
+                "scanning it instead.\n");
+        tiled_free(pic);
+        if (vpeg_index_speculative(bitstream, len, idx, threads) < 0) {
+            fprintf(stderr, "Malformed stream.\n");
+            return 1;
         }
-        quant_block_t zqb, qb;
-        // Inverse RLE
-        int quantvalue = irle(zqb, (signed char *&) bitstream);
-        // Inverse zig-zag
-        izigzag(zqb, qb);
-        block_t bl;
-        // Dequantify
-        dequant(bl, qb, quantvalue);
-        // Inverse DCT
-        idct88(bl);
-        // Map block to picture
-        for (int y = 0; y < 8; y++) {
-            // Round-off errors may turn values in slightly less than 0, 
-            // or slightly greater than 255. Here we make sure it fits 
-            // within a byte.
-#define CLAMP(val) ((val) < 0 ? 0 : ((val) > 255 ? 255 : (val)))
-            for (int x = 0; x < 8; x++) {
-                unsigned char pixelvalue = (unsigned char) CLAMP(bl[y][x]);
-                pic[y+row*8][x+col*8] = pixelvalue;
-            }
+        if (alloc_picture(pic, idx, bitstream == data) < 0) {
+            fprintf(stderr, "Picture too large to decode.\n");
+            return 1;
         }
-        col++;
+        vpeg_decode_tiled(bitstream, idx, pic, threads);
+    }
+    printf("Reached EOF.\n");
+
+    if (write_pgm_tiled(output, pic) < 0) {
+        perror(output);
+        return 1;
     }
-    FILE *f = fopen("image.pgm", "wb");
-    fprintf(f, "P5 320 320 255\n");
-    fwrite(pic, sizeof(pic), 1, f);
     printf("Wrote to file.\n");
-    fclose(f);
+    tiled_free(pic);
     printf("Closed file.\n");
     return 0;
 }
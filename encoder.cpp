@@ -0,0 +1,187 @@
+/*
+ * VPEG encoder: forward DCT, quantization, zig-zag scan and the token
+ * writer, run on rows of blocks in parallel.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#include "vpeg.h"
+
+// fdct_basis[k][n] = cos(pi/8 * n * (k + 1/2)), laid out so that the inner
+// loop of fdct88() runs over n and vectorizes.
+static double fdct_basis[8][8];
+
+static struct fdct_init {
+    fdct_init()
+    {
+        for (int k = 0; k < 8; k++)
+            for (int n = 0; n < 8; n++)
+                fdct_basis[k][n] = cos(M_PI / 8 * n * (k + 0.5));
+    }
+} fdct_init_;
+
+// Forward DCT of each row, the exact inverse of idct() (which scales by
+// 2/8 and halves the DC term).
+__attribute__((target_clones("avx2", "default")))
+static void fdct_rows(block_t &m)
+{
+    for (int i = 0; i < 8; i++) {
+        double sum[8] = { 0 };
+        for (int k = 0; k < 8; k++)
+            for (int n = 0; n < 8; n++)
+                sum[n] += m[i][k] * fdct_basis[k][n];
+        for (int n = 0; n < 8; n++)
+            m[i][n] = sum[n];
+    }
+}
+
+// Forward 8-by-8 DCT. idct88() runs rows, transpose, rows, so undoing it
+// takes the same steps with the forward transform.
+void fdct88(block_t &m)
+{
+    fdct_rows(m);
+    transpose(m);
+    fdct_rows(m);
+}
+
+// Forward quantization, the inverse of dequant(). Values are clamped to
+// what the tokens can carry: 0b100zzzzs stores the magnitude in a single
+// signed byte.
+void quant(quant_block_t &qm, block_t &m, int value)
+{
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++) {
+            double v = m[y][x] / (quant_values[value][(y>4) + (x>4)] * 8);
+            int q = (int) lround(v);
+            if (y || x)
+                q = q < -127 ? -127 : (q > 127 ? 127 : q);
+            qm[y][x] = q;
+        }
+}
+
+// Zig-zag reshuffling, the inverse of izigzag().
+void zigzag(quant_block_t &in, quant_block_t &out)
+{
+    const short *src = &in[0][0];
+    short *dst = &out[0][0];
+    for (int i = 0; i < 64; i++)
+        dst[zigzag_order[i]] = src[i];
+}
+
+// Quantized coefficients of block (row, col), in raster order. Pixels past
+// the right or bottom edge repeat the last column or row.
+void encode_coefficients(const frame_t &f, int row, int col, int quantval,
+                         quant_block_t &qm)
+{
+    block_t bl;
+    for (int y = 0; y < 8; y++) {
+        int py = row * 8 + y < f.height ? row * 8 + y : f.height - 1;
+        const unsigned char *src = f.pixels + (size_t) py * f.stride;
+        for (int x = 0; x < 8; x++) {
+            int px = col * 8 + x < f.width ? col * 8 + x : f.width - 1;
+            bl[y][x] = src[px];
+        }
+    }
+    fdct88(bl);
+    quant(qm, bl, quantval);
+}
+
+static void encode_row(const frame_t &f, int row, int quantval, int n,
+                       std::vector<unsigned char> &out)
+{
+    int cols = (f.width + n - 1) / n;
+    for (int col = 0; col < cols; col++) {
+        if (n != 8) {
+            short zz[16 * 16];
+            encode_block_n(f, n, row, col, quantval, zz);
+            emit_block(out, zz, quantval, n * n);
+            continue;
+        }
+        quant_block_t qm, zz;
+        encode_coefficients(f, row, col, quantval, qm);
+        zigzag(qm, zz);
+        emit_block(out, &zz[0][0], quantval);
+    }
+    emit_row_end(out);
+}
+
+void vpeg_encode(const frame_t &f, int quantval, int threads,
+                 std::vector<unsigned char> &out, int block_size)
+{
+    int rows = (f.height + block_size - 1) / block_size;
+    std::vector<std::vector<unsigned char> > parts(rows);
+
+    if (threads > rows)
+        threads = rows;
+    if (threads <= 1) {
+        for (int row = 0; row < rows; row++)
+            encode_row(f, row, quantval, block_size, parts[row]);
+    } else {
+        /* Rows are encoded independently and concatenated in order. */
+        std::atomic<int> next_row(0);
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.push_back(std::thread([&]() {
+                int row;
+                while ((row = next_row++) < rows)
+                    encode_row(f, row, quantval, block_size, parts[row]);
+            }));
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+    }
+
+    out.clear();
+    if (block_size != 8)
+        emit_block_size(out, block_size);
+    for (int row = 0; row < rows; row++)
+        out.insert(out.end(), parts[row].begin(), parts[row].end());
+    emit_eof(out);
+}
+
+// Reads the next header field of a PGM file, skipping comments.
+static int pgm_field(FILE *fp)
+{
+    int c, v;
+    while ((c = fgetc(fp)) == '#' || c == ' ' || c == '\t' || c == '\r' ||
+           c == '\n')
+        if (c == '#')
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+    if (c == EOF)
+        return -1;
+    ungetc(c, fp);
+    return fscanf(fp, "%d", &v) == 1 ? v : -1;
+}
+
+int read_pgm(const char *path, frame_t &f)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    int width = -1, height = -1, maxval = -1;
+    if (fgetc(fp) == 'P' && fgetc(fp) == '5') {
+        width = pgm_field(fp);
+        height = pgm_field(fp);
+        maxval = pgm_field(fp);
+    }
+    /* Exactly one whitespace byte separates the header from the pixels. */
+    if (width <= 0 || height <= 0 || maxval != 255 || fgetc(fp) == EOF) {
+        fclose(fp);
+        return -1;
+    }
+    if (frame_alloc(f, width, height) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    size_t n = fread(f.pixels, 1, (size_t) width * height, fp);
+    fclose(fp);
+    if (n != (size_t) width * height) {
+        frame_free(f);
+        return -1;
+    }
+    return 0;
+}
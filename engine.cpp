@@ -0,0 +1,367 @@
+/*
+ * Block transforms for any block size N. The 8x8 code in vpeg.cpp and
+ * encoder.cpp stays the reference for plain streams; everything here is
+ * one template, block_engine<N>, instantiated for 4, 8 and 16.
+ *
+ * A stream picks its block size with a header at the very start,
+ *
+ * 0b10101000 0bnnnnnnnn:            the blocks are nnnnnnnn x nnnnnnnn
+ *
+ * so vpeg_index() sets block_size before the first block. It is not a skip
+ * record on purpose: a decoder that only knows 8x8 blocks must refuse the
+ * stream, not run N*N coefficients into an 8x8 block. Tokens are
+ * unchanged, a block just carries N*N coefficients in the same diagonal
+ * scan. Scaling follows the 8x8 code:
+ * the pinned DC value gives the same mid-gray for every N, and a
+ * coefficient step changes the pixels by the same amount. The
+ * quantization zones cover the same share of the block. The inverse is
+ * double precision unless -t picked a single precision transform, as for
+ * the 8x8 code.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "vpeg.h"
+
+// cos() for the constant tables: folded into [-pi, pi], then a Taylor
+// series that has converged to double precision long before the end.
+static constexpr double ce_cos(double x)
+{
+    while (x > M_PI)
+        x -= 2 * M_PI;
+    double term = 1, sum = 1;
+    for (int i = 1; i < 30; i++) {
+        term *= -x * x / ((2 * i - 1) * (2 * i));
+        sum += term;
+    }
+    return sum;
+}
+
+template <int N>
+struct block_engine {
+    enum { coefs = N * N };
+
+    struct tables_t {
+        float basis[N][N];      // inverse: what coefficient n adds to sample k
+        double dbasis[N][N];    // the same in double precision
+        double fbasis[N][N];    // forward: cos(pi/N * n * (k + 1/2)) at [k][n]
+        short zigzag[N * N];    // scan position of each raster position
+        unsigned char zone[N * N];      // column of quant_values
+    };
+
+    // The scan runs along anti-diagonals, each from bottom-left to top-right
+    // like zigzag_order, which this reproduces for N = 8.
+    static constexpr tables_t make_tables()
+    {
+        tables_t t {};
+        for (int n = 0; n < N; n++)
+            for (int k = 0; k < N; k++) {
+                double c = ce_cos(M_PI / N * n * (k + 0.5));
+                t.dbasis[n][k] = (n ? c : 0.5) * (2.0 / N);
+                t.basis[n][k] = t.dbasis[n][k];
+                t.fbasis[k][n] = c;
+            }
+        int scan = 0;
+        for (int d = 0; d < 2 * N - 1; d++)
+            for (int y = d < N ? d : N - 1; y >= 0 && d - y < N; y--)
+                t.zigzag[y * N + d - y] = scan++;
+        for (int y = 0; y < N; y++)
+            for (int x = 0; x < N; x++)
+                t.zone[y * N + x] = (y * 8 / N > 4) + (x * 8 / N > 4);
+        return t;
+    }
+
+    static constexpr tables_t tab = make_tables();
+
+    // dequant() multiplies by 8 and pins DC at 16384; these keep the same
+    // pixel-domain meaning for other sizes.
+    static constexpr int step = N * N / 8;
+    static constexpr float dc = 256.0f * N * N;
+
+    // Dequantization, inverse DCT and store of a block given in scan
+    // order. Rows of coefficients that are all zero are skipped in both
+    // passes, which is most of them at higher quantization levels. T is
+    // double for the reference and float once transform_select() allows it.
+    template <typename T>
+    static void inverse(const short *zz, int quantval, unsigned char *dst,
+                        int stride, const T (&basis)[N][N])
+    {
+        T m[N][N], a[N][N];
+        int live[N], nlive = 0;
+        for (int i = 0; i < N; i++) {
+            int any = 0;
+            for (int n = 0; n < N; n++) {
+                int r = i * N + n;
+                m[i][n] = zz[tab.zigzag[r]] * quant_values[quantval][tab.zone[r]] * step;
+                any |= zz[tab.zigzag[r]];
+            }
+            if (i == 0) {
+                m[0][0] = dc;
+                any = 1;
+            }
+            if (any)
+                live[nlive++] = i;
+        }
+        for (int l = 0; l < nlive; l++) {
+            int i = live[l];
+            for (int k = 0; k < N; k++)
+                a[i][k] = 0;
+            for (int n = 0; n < N; n++)
+                if (m[i][n] != 0)
+                    for (int k = 0; k < N; k++)
+                        a[i][k] += m[i][n] * basis[n][k];
+        }
+        for (int y = 0; y < N; y++) {
+            T sum[N];
+            for (int x = 0; x < N; x++)
+                sum[x] = 0;
+            for (int l = 0; l < nlive; l++) {
+                int i = live[l];
+                for (int x = 0; x < N; x++)
+                    sum[x] += a[i][y] * basis[i][x];
+            }
+            for (int x = 0; x < N; x++) {
+                T v = sum[x] < 0 ? 0 : (sum[x] > 255 ? 255 : sum[x]);
+                dst[x] = (unsigned char) v;
+            }
+            dst += stride;
+        }
+    }
+
+    // Forward DCT and quantization of block (row, col) into scan order,
+    // repeating the last column or row past the picture edge like
+    // encode_coefficients().
+    static void forward(const frame_t &f, int row, int col, int quantval,
+                        short *zz)
+    {
+        double p[N][N], b[N][N];
+        for (int y = 0; y < N; y++) {
+            int py = row * N + y < f.height ? row * N + y : f.height - 1;
+            const unsigned char *src = f.pixels + (size_t) py * f.stride;
+            for (int x = 0; x < N; x++) {
+                int px = col * N + x < f.width ? col * N + x : f.width - 1;
+                p[y][x] = src[px];
+            }
+        }
+        for (int y = 0; y < N; y++) {
+            for (int i = 0; i < N; i++)
+                b[y][i] = 0;
+            for (int x = 0; x < N; x++)
+                for (int i = 0; i < N; i++)
+                    b[y][i] += p[y][x] * tab.fbasis[x][i];
+        }
+        for (int i = 0; i < N; i++) {
+            double m[N];
+            for (int n = 0; n < N; n++)
+                m[n] = 0;
+            for (int y = 0; y < N; y++)
+                for (int n = 0; n < N; n++)
+                    m[n] += b[y][i] * tab.fbasis[y][n];
+            for (int n = 0; n < N; n++) {
+                int r = i * N + n;
+                long q = lround(m[n] / (quant_values[quantval][tab.zone[r]] * step));
+                if (r)
+                    q = q < -127 ? -127 : (q > 127 ? 127 : q);
+                else
+                    q = q < -32768 ? -32768 : (q > 32767 ? 32767 : q);
+                zz[tab.zigzag[r]] = q;
+            }
+        }
+    }
+};
+
+// One entry point per size, so each gets its own vectorized clones.
+#define ENGINE_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+
+ENGINE_CLONES static void inverse4(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<4>::inverse(zz, q, dst, stride, block_engine<4>::tab.basis);
+}
+
+ENGINE_CLONES static void inverse8(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<8>::inverse(zz, q, dst, stride, block_engine<8>::tab.basis);
+}
+
+ENGINE_CLONES static void inverse16(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<16>::inverse(zz, q, dst, stride, block_engine<16>::tab.basis);
+}
+
+ENGINE_CLONES static void inverse4d(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<4>::inverse(zz, q, dst, stride, block_engine<4>::tab.dbasis);
+}
+
+ENGINE_CLONES static void inverse8d(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<8>::inverse(zz, q, dst, stride, block_engine<8>::tab.dbasis);
+}
+
+ENGINE_CLONES static void inverse16d(const short *zz, int q, unsigned char *dst, int stride)
+{
+    block_engine<16>::inverse(zz, q, dst, stride, block_engine<16>::tab.dbasis);
+}
+
+ENGINE_CLONES static void forward4(const frame_t &f, int row, int col, int q, short *zz)
+{
+    block_engine<4>::forward(f, row, col, q, zz);
+}
+
+ENGINE_CLONES static void forward8(const frame_t &f, int row, int col, int q, short *zz)
+{
+    block_engine<8>::forward(f, row, col, q, zz);
+}
+
+ENGINE_CLONES static void forward16(const frame_t &f, int row, int col, int q, short *zz)
+{
+    block_engine<16>::forward(f, row, col, q, zz);
+}
+
+int valid_block_size(int n)
+{
+    return n == 4 || n == 8 || n == 16;
+}
+
+int parse_block_size(const unsigned char *data, size_t len)
+{
+    if (len == 0 || data[0] != 0xa8)
+        return 8;
+    return len >= 2 && valid_block_size(data[1]) ? data[1] : -1;
+}
+
+size_t stream_start(const unsigned char *data, size_t len)
+{
+    return len >= 2 && data[0] == 0xa8 ? 2 : 0;
+}
+
+void emit_block_size(std::vector<unsigned char> &out, int n)
+{
+    out.push_back(0xa8);
+    out.push_back(n);
+}
+
+// irle() for any size. Coefficients past n * n are dropped rather than
+// written out of bounds. The byte after a run token is signed, as irle()
+// reads it. Any other byte with the top bit set ends the block unread, so
+// a row or file end, or the next header, is left to the caller; streams
+// that passed vpeg_index() never have one before the 0xac.
+int parse_block(short *zz, int n, unsigned char *&bitstream)
+{
+    int count = n * n, pos = 1;
+    PROF_START();
+    memset(zz, 0, count * sizeof(*zz));
+    CHECKSKIP;
+    int quantval = bitstream[0] & 0x03;
+    zz[0] = (bitstream[1] << 8) | bitstream[2];
+    bitstream += 3;
+    while (1) {
+        CHECKSKIP;
+        unsigned char b = *bitstream;
+        if (b == 0xac) {
+            bitstream++;
+            PROF_STAGE(PROF_PARSE);
+            return quantval;
+        } else if (!(b & 0x80)) {
+            if (pos < count)
+                zz[pos] = (b & 0x3f) * ((b & 0x40) ? -1 : 1);
+            pos++;
+            bitstream++;
+            PROF_COUNT(coefficients, 1);
+        } else if ((b & 0xe0) == 0x80) {
+            pos += (b & 0x1e) >> 1;
+            if (pos < count)
+                zz[pos] = (signed char) bitstream[1] * (b & 0x1 ? -1 : 1);
+            pos++;
+            bitstream += 2;
+            PROF_COUNT(runs, 1);
+        } else {
+            PROF_STAGE(PROF_PARSE);
+            return quantval;
+        }
+    }
+}
+
+void reconstruct_block_n(const short *zz, int n, int quantval, frame_t &f,
+                         int row, int col)
+{
+    if ((row + 1) * n > f.height || (col + 1) * n > f.width)
+        return;
+    unsigned char *dst = f.pixels + (size_t) row * n * f.stride + col * n;
+    PROF_START();
+    if (vpeg_transform != TRANSFORM_DOUBLE) {
+        if (n == 4)
+            inverse4(zz, quantval, dst, f.stride);
+        else if (n == 16)
+            inverse16(zz, quantval, dst, f.stride);
+        else
+            inverse8(zz, quantval, dst, f.stride);
+    } else if (n == 4) {
+        inverse4d(zz, quantval, dst, f.stride);
+    } else if (n == 16) {
+        inverse16d(zz, quantval, dst, f.stride);
+    } else {
+        inverse8d(zz, quantval, dst, f.stride);
+    }
+    PROF_STAGE(PROF_IDCT);
+}
+
+// transform_error() for the single precision engine: the largest pixel
+// difference from the double one over random blocks of every size.
+int engine_error(void)
+{
+    static void (*const single[])(const short *, int, unsigned char *, int) =
+        { inverse4, inverse8, inverse16 };
+    static void (*const ref[])(const short *, int, unsigned char *, int) =
+        { inverse4d, inverse8d, inverse16d };
+    unsigned long long s = 0x9e3779b97f4a7c15ULL;
+    int worst = 0;
+    for (int blk = 0; blk < 3 * 4096; blk++) {
+        int size = blk % 3, n = 4 << size, count = n * n;
+        int density = 1 + (blk >> 2) % count, range = (blk >> 8) & 1 ? 127 : 16;
+        short zz[16 * 16];
+        for (int i = 0; i < count; i++) {
+            s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+            unsigned r = (s * 0x2545f4914f6cdd1dULL) >> 32;
+            zz[i] = r % count < (unsigned) density ? (int) ((r >> 8) % (2 * range + 1)) - range : 0;
+        }
+        unsigned char want[16 * 16], got[16 * 16];
+        ref[size](zz, blk & 3, want, n);
+        single[size](zz, blk & 3, got, n);
+        for (int i = 0; i < count; i++)
+            worst = std::max(worst, abs(want[i] - got[i]));
+    }
+    return worst;
+}
+
+void encode_block_n(const frame_t &f, int n, int row, int col, int quantval,
+                    short *zz)
+{
+    if (n == 4)
+        forward4(f, row, col, quantval, zz);
+    else if (n == 16)
+        forward16(f, row, col, quantval, zz);
+    else
+        forward8(f, row, col, quantval, zz);
+}
+
+// decode_row() for streams with a block size other than 8.
+void decode_row_n(unsigned char *bitstream, int n, frame_t &f, int row,
+                  unsigned char *quant)
+{
+    short zz[16 * 16];
+    for (int col = 0; ; col++) {
+        CHECKSKIP;
+        if (*bitstream == 0xae || *bitstream == 0xaf)
+            return;
+        PROF_START();
+        int quantval = parse_block(zz, n, bitstream);
+        reconstruct_block_n(zz, n, quantval, f, row, col);
+        PROF_BLOCK(prof_coefficients(zz, n * n), prof_t);
+        if (quant && (col + 1) * n <= f.width)
+            quant[col] = quantval + 1;
+    }
+}
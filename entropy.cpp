@@ -0,0 +1,609 @@
+/*
+ * VPEG v2: the same block, row and end-of-file structure as v1, but with
+ * every token Huffman coded.
+ *
+ * File layout (integers big-endian):
+ *
+ *   "VPG2"
+ *   u16 cols, u16 rows          picture size in blocks
+ *   u8  bits[16]                number of codes of each length 1..16
+ *   u8  symbols[sum of bits]    canonical order
+ *   u32 segments                rows of tokens, including empty ones
+ *   u32 offset[segments]        byte offset of each row in the payload
+ *   u32 payload length
+ *   payload
+ *
+ * Symbols are JPEG-style run/size bytes, 0xrs: r zeros, then a coefficient
+ * whose magnitude needs s bits, the s bits following the code (a leading
+ * 0 bit means negative, as in JPEG). 0xf0 is 16 zeros and 0x00 ends a
+ * block. The other s = 0 symbols carry the structure of v1:
+ *
+ *   0x10  next row of blocks, then padding to a byte boundary
+ *   0x20  end of file
+ *   0x30  skip record: 8-bit length, then the payload bytes
+ *   0x40, 0x50, 0x60, 0x70
+ *        start of block with quantization level 0 to 3, then 16 bits of DC
+ *
+ * Rows start byte aligned and their offsets are in the header, so rows can
+ * be decoded in parallel just like with stream_index_t in v1.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "vpeg.h"
+
+#define SYM_EOB   0x00
+#define SYM_ROW   0x10
+#define SYM_EOF   0x20
+#define SYM_SKIP  0x30
+#define SYM_BLOCK(q) (0x40 + ((q) << 4))
+#define SYM_ZRL   0xf0
+
+#define MAX_CODE_BITS 16
+#define LOOKUP_BITS 11
+
+struct bitwriter_t {
+    std::vector<unsigned char> *out;
+    unsigned long long buf;
+    int bits;
+};
+
+static void put_bits(bitwriter_t &w, unsigned value, int n)
+{
+    w.buf = (w.buf << n) | (value & ((1ULL << n) - 1));
+    w.bits += n;
+    while (w.bits >= 8) {
+        w.bits -= 8;
+        w.out->push_back(w.buf >> w.bits);
+    }
+}
+
+static void align_bits(bitwriter_t &w)
+{
+    if (w.bits)
+        put_bits(w, 0, 8 - w.bits);
+}
+
+static void put_u16(std::vector<unsigned char> &out, unsigned v)
+{
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void put_u32(std::vector<unsigned char> &out, unsigned long v)
+{
+    put_u16(out, v >> 16);
+    put_u16(out, v & 0xffff);
+}
+
+static unsigned long get_u32(const unsigned char *p)
+{
+    return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Bits needed for the magnitude of v.
+static int magnitude_bits(int v)
+{
+    int n = 0;
+    for (v = v < 0 ? -v : v; v; v >>= 1)
+        n++;
+    return n;
+}
+
+// A token before Huffman coding: a symbol plus raw bits.
+struct token_t {
+    unsigned char sym;
+    unsigned char nbits;
+    unsigned short bits;
+};
+
+static void add_token(std::vector<token_t> &t, int sym, int nbits, unsigned bits)
+{
+    token_t tok = { (unsigned char) sym, (unsigned char) nbits, (unsigned short) bits };
+    t.push_back(tok);
+}
+
+// Skip payload bytes are raw bits behind symbol 0xff, which is never
+// coded: magnitude sizes stop at 8.
+static void add_skip(std::vector<token_t> &t, const unsigned char *payload, int len)
+{
+    add_token(t, SYM_SKIP, 8, len);
+    for (int i = 0; i < len; i++)
+        add_token(t, -1, 8, payload[i]);
+}
+
+// Tokens of one block. zz is in scan order with zz[0] the DC as written.
+static void add_block(std::vector<token_t> &t, const short *zz, int quantval)
+{
+    add_token(t, SYM_BLOCK(quantval), 16, (unsigned short) zz[0]);
+    int last = 63;
+    while (last > 0 && zz[last] == 0)
+        last--;
+    int run = 0;
+    for (int i = 1; i <= last; i++) {
+        if (zz[i] == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            add_token(t, SYM_ZRL, 0, 0);
+            run -= 16;
+        }
+        int size = magnitude_bits(zz[i]);
+        unsigned bits = zz[i] > 0 ? zz[i] : zz[i] + (1 << size) - 1;
+        add_token(t, (run << 4) | size, size, bits);
+        run = 0;
+    }
+    add_token(t, SYM_EOB, 0, 0);
+}
+
+// Code lengths limited to MAX_CODE_BITS, in the form of the JPEG BITS list,
+// with symbols in the order their codes are assigned (Annex K.2 and K.3).
+static void build_code(const unsigned long *freq, unsigned char *bits,
+                       std::vector<unsigned char> &symbols)
+{
+    int codesize[257], others[257];
+    unsigned long f[257];
+    for (int i = 0; i < 256; i++)
+        f[i] = freq[i];
+    /* One reserved symbol keeps any real code from being all ones. */
+    f[256] = 1;
+    for (int i = 0; i < 257; i++) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+    while (1) {
+        int c1 = -1, c2 = -1;
+        for (int i = 0; i < 257; i++)
+            if (f[i] && (c1 < 0 || f[i] <= f[c1]))
+                c1 = i;
+        for (int i = 0; i < 257; i++)
+            if (f[i] && i != c1 && (c2 < 0 || f[i] <= f[c2]))
+                c2 = i;
+        if (c2 < 0)
+            break;
+        f[c1] += f[c2];
+        f[c2] = 0;
+        for (codesize[c1]++; others[c1] >= 0; codesize[c1]++)
+            c1 = others[c1];
+        others[c1] = c2;
+        for (codesize[c2]++; others[c2] >= 0; codesize[c2]++)
+            c2 = others[c2];
+    }
+
+    int count[64] = { 0 };
+    for (int i = 0; i < 257; i++)
+        if (codesize[i])
+            count[std::min(codesize[i], 63)]++;
+    for (int i = 63; i > MAX_CODE_BITS; i--) {
+        while (count[i] > 0) {
+            int j = i - 2;
+            while (count[j] == 0)
+                j--;
+            count[i] -= 2;
+            count[i - 1]++;
+            count[j + 1] += 2;
+            count[j]--;
+        }
+    }
+    /* Drop the reserved symbol from the longest length. */
+    int i = MAX_CODE_BITS;
+    while (count[i] == 0)
+        i--;
+    count[i]--;
+    for (i = 1; i <= MAX_CODE_BITS; i++)
+        bits[i - 1] = count[i];
+
+    symbols.clear();
+    for (int len = 1; len < 64; len++)
+        for (int s = 0; s < 256; s++)
+            if (codesize[s] == len)
+                symbols.push_back(s);
+}
+
+// Canonical codes from a BITS list and symbol order.
+static void assign_codes(const unsigned char *bits,
+                         const std::vector<unsigned char> &symbols,
+                         unsigned *code, unsigned char *length)
+{
+    unsigned c = 0;
+    size_t k = 0;
+    memset(length, 0, 256);
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        for (int i = 0; i < bits[len - 1]; i++, k++) {
+            code[symbols[k]] = c++;
+            length[symbols[k]] = len;
+        }
+        c <<= 1;
+    }
+}
+
+int v1_to_v2(unsigned char *data, size_t len, std::vector<unsigned char> &out)
+{
+    stream_index_t idx;
+    std::vector<skip_record_t> skips;
+    if (vpeg_index(data, len, idx, &skips) < 0 || idx.block_size != 8)
+        return -1;
+
+    /* Tokenize by row: skip records go in front of the block they were
+       found before or inside, blocks are parsed with parse_block(), which
+       also copes with untrusted streams. */
+    std::vector<std::vector<token_t> > rows;
+    rows.push_back(std::vector<token_t>());
+    size_t next_skip = 0;
+    int row = 0, col = 0;
+    signed char *bitstream = (signed char *) data;
+    while (1) {
+        while (next_skip < skips.size() && skips[next_skip].row == row &&
+               skips[next_skip].col == col) {
+            /* v2 has its own row index, an embedded v1 one goes stale. */
+            if (!is_row_index_record(data + skips[next_skip].offset + 2,
+                                     skips[next_skip].len))
+                add_skip(rows.back(), data + skips[next_skip].offset + 2,
+                         skips[next_skip].len);
+            next_skip++;
+        }
+        CHECKSKIP;
+        unsigned char b = *bitstream;
+        if (b == 0xaf) {
+            add_token(rows.back(), SYM_EOF, 0, 0);
+            break;
+        } else if (b == 0xae) {
+            add_token(rows.back(), SYM_ROW, 0, 0);
+            rows.push_back(std::vector<token_t>());
+            bitstream++;
+            row++;
+            col = 0;
+        } else {
+            short zz[64];
+            unsigned char *tokens = (unsigned char *) bitstream;
+            int quantval = parse_block(zz, 8, tokens);
+            bitstream = (signed char *) tokens;
+            add_block(rows.back(), zz, quantval);
+            col++;
+        }
+    }
+
+    unsigned long freq[256] = { 0 };
+    for (size_t r = 0; r < rows.size(); r++)
+        for (size_t i = 0; i < rows[r].size(); i++)
+            if (rows[r][i].sym != 0xff)
+                freq[rows[r][i].sym]++;
+    unsigned char bits[MAX_CODE_BITS];
+    std::vector<unsigned char> symbols;
+    build_code(freq, bits, symbols);
+    unsigned code[256];
+    unsigned char length[256];
+    assign_codes(bits, symbols, code, length);
+
+    std::vector<unsigned char> payload;
+    std::vector<unsigned long> offsets;
+    bitwriter_t w = { &payload, 0, 0 };
+    for (size_t r = 0; r < rows.size(); r++) {
+        offsets.push_back(payload.size());
+        for (size_t i = 0; i < rows[r].size(); i++) {
+            const token_t &t = rows[r][i];
+            if (t.sym != 0xff)
+                put_bits(w, code[t.sym], length[t.sym]);
+            if (t.nbits)
+                put_bits(w, t.bits, t.nbits);
+        }
+        align_bits(w);
+    }
+
+    out.clear();
+    for (int i = 0; i < 4; i++)
+        out.push_back("VPG2"[i]);
+    put_u16(out, idx.cols);
+    put_u16(out, idx.rows);
+    for (int i = 0; i < MAX_CODE_BITS; i++)
+        out.push_back(bits[i]);
+    for (size_t i = 0; i < symbols.size(); i++)
+        out.push_back(symbols[i]);
+    put_u32(out, offsets.size());
+    for (size_t r = 0; r < offsets.size(); r++)
+        put_u32(out, offsets[r]);
+    put_u32(out, payload.size());
+    out.insert(out.end(), payload.begin(), payload.end());
+    return 0;
+}
+
+// Decoding tables. A lookup on the next LOOKUP_BITS bits gives the symbol
+// and, when its magnitude bits fit as well, the coefficient value too, so
+// most coefficients cost a single table access.
+struct v2_table_t {
+    struct entry_t {
+        unsigned char sym;
+        unsigned char len;      // code bits, 0 if the code is longer
+        unsigned char total;    // code and magnitude bits, 0 if they don't fit
+        short value;
+    } lookup[1 << LOOKUP_BITS];
+    /* Canonical decoding of the longer codes, per length. */
+    int maxcode[MAX_CODE_BITS + 2];
+    int valptr[MAX_CODE_BITS + 1];
+    unsigned mincode[MAX_CODE_BITS + 1];
+    unsigned char symbols[256];
+};
+
+struct v2_header_t {
+    int cols, rows;
+    unsigned long segments;
+    const unsigned char *offsets;
+    const unsigned char *payload, *end;
+    v2_table_t table;
+};
+
+static int magnitude_value(unsigned bits, int size)
+{
+    if (size == 0)
+        return 0;
+    return bits >> (size - 1) ? (int) bits : (int) bits - (1 << size) + 1;
+}
+
+static int parse_header(const unsigned char *data, size_t len, v2_header_t &h)
+{
+    if (len < 24 || memcmp(data, "VPG2", 4))
+        return -1;
+    const unsigned char *p = data + 4, *end = data + len;
+    h.cols = (p[0] << 8) | p[1];
+    h.rows = (p[2] << 8) | p[3];
+    const unsigned char *bits = p + 4;
+    p += 4 + MAX_CODE_BITS;
+    int nsymbols = 0;
+    for (int i = 0; i < MAX_CODE_BITS; i++)
+        nsymbols += bits[i];
+    if (nsymbols > 256 || p + nsymbols + 4 > end)
+        return -1;
+    memcpy(h.table.symbols, p, nsymbols);
+    p += nsymbols;
+    h.segments = get_u32(p);
+    p += 4;
+    if (h.segments > (size_t) (end - p) / 4 || p + h.segments * 4 + 4 > end)
+        return -1;
+    h.offsets = p;
+    p += h.segments * 4;
+    unsigned long payload_len = get_u32(p);
+    p += 4;
+    if (payload_len > (size_t) (end - p))
+        return -1;
+    h.payload = p;
+    h.end = p + payload_len;
+    for (unsigned long r = 0; r < h.segments; r++)
+        if (get_u32(h.offsets + r * 4) > payload_len)
+            return -1;
+
+    v2_table_t &t = h.table;
+    memset(t.lookup, 0, sizeof(t.lookup));
+    unsigned code = 0;
+    int k = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        /* More codes of this length than it has room for. */
+        if (code + bits[len - 1] > (1u << len))
+            return -1;
+        t.valptr[len] = k;
+        t.mincode[len] = code;
+        t.maxcode[len] = bits[len - 1] ? (int) (code + bits[len - 1] - 1) : -1;
+        for (int i = 0; i < bits[len - 1]; i++, k++, code++) {
+            if (len > LOOKUP_BITS)
+                continue;
+            int sym = t.symbols[k];
+            int size = sym & 0x0f;
+            int spare = LOOKUP_BITS - len;
+            for (unsigned fill = 0; fill < (1u << spare); fill++) {
+                v2_table_t::entry_t &e = t.lookup[(code << spare) | fill];
+                e.sym = sym;
+                e.len = len;
+                if (size && len + size <= LOOKUP_BITS) {
+                    e.total = len + size;
+                    e.value = magnitude_value(fill >> (spare - size), size);
+                }
+            }
+        }
+        code <<= 1;
+    }
+    t.maxcode[MAX_CODE_BITS + 1] = 0x7fffffff;
+    return 0;
+}
+
+struct bitreader_t {
+    const unsigned char *p, *end;
+    unsigned long long buf;
+    int bits;
+};
+
+// Past the end the reader feeds zeros; callers check overrun() instead of
+// testing every byte.
+static inline void refill(bitreader_t &r)
+{
+    while (r.bits <= 56) {
+        unsigned long long b = r.p < r.end ? *r.p : 0;
+        r.p++;
+        r.buf |= b << (56 - r.bits);
+        r.bits += 8;
+    }
+}
+
+static inline unsigned get_bits(bitreader_t &r, int n)
+{
+    if (n == 0)
+        return 0;
+    refill(r);
+    unsigned v = r.buf >> (64 - n);
+    r.buf <<= n;
+    r.bits -= n;
+    return v;
+}
+
+static inline int overrun(const bitreader_t &r)
+{
+    return r.p > r.end + 8;
+}
+
+// Next symbol; for coefficients whose magnitude fit in the lookup, the
+// value is decoded too and *value_done set.
+static inline int get_symbol(bitreader_t &r, const v2_table_t &t, int &value,
+                             int &value_done)
+{
+    refill(r);
+    const v2_table_t::entry_t &e = t.lookup[r.buf >> (64 - LOOKUP_BITS)];
+    if (e.total) {
+        r.buf <<= e.total;
+        r.bits -= e.total;
+        value = e.value;
+        value_done = 1;
+        return e.sym;
+    }
+    value_done = 0;
+    if (e.len) {
+        r.buf <<= e.len;
+        r.bits -= e.len;
+        return e.sym;
+    }
+    /* Longer code: walk the canonical lengths. */
+    int len = LOOKUP_BITS + 1;
+    unsigned code = r.buf >> (64 - len);
+    while (len <= MAX_CODE_BITS && (t.maxcode[len] < 0 || (int) code > t.maxcode[len])) {
+        len++;
+        code = r.buf >> (64 - len);
+    }
+    r.buf <<= len;
+    r.bits -= len;
+    if (len > MAX_CODE_BITS)
+        return -1;
+    return t.symbols[t.valptr[len] + code - t.mincode[len]];
+}
+
+// Calls block(zz, quantval, col) for every block of one row, and skip(payload,
+// len) for every skip record. Returns -1 on a corrupt row.
+template <typename block_fn, typename skip_fn>
+static int v2_walk_row(const v2_header_t &h, unsigned long segment,
+                       block_fn block, skip_fn skip, int &ended)
+{
+    bitreader_t r = { h.payload + get_u32(h.offsets + segment * 4), h.end, 0, 0 };
+    int col = 0;
+    ended = 0;
+    while (!overrun(r)) {
+        int value = 0, value_done;
+        int sym = get_symbol(r, h.table, value, value_done);
+        if (sym == SYM_ROW) {
+            return 0;
+        } else if (sym == SYM_EOF) {
+            ended = 1;
+            return 0;
+        } else if (sym == SYM_SKIP) {
+            unsigned char payload[255];
+            int len = get_bits(r, 8);
+            for (int i = 0; i < len; i++)
+                payload[i] = get_bits(r, 8);
+            skip(payload, len);
+        } else if (sym >= SYM_BLOCK(0) && sym <= SYM_BLOCK(3) && !(sym & 0x0f)) {
+            int quantval = (sym - SYM_BLOCK(0)) >> 4;
+            short zz[64];
+            memset(zz, 0, sizeof(zz));
+            zz[0] = get_bits(r, 16);
+            int pos = 1;
+            while (1) {
+                sym = get_symbol(r, h.table, value, value_done);
+                if (sym == SYM_EOB)
+                    break;
+                if (sym < 0 || overrun(r))
+                    return -1;
+                pos += sym >> 4;
+                if (sym == SYM_ZRL) {
+                    pos++;
+                    continue;
+                }
+                int size = sym & 0x0f;
+                if (size == 0 || pos > 63)
+                    return -1;
+                if (!value_done)
+                    value = magnitude_value(get_bits(r, size), size);
+                zz[pos++] = value;
+            }
+            block(zz, quantval, col++);
+        } else {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int v2_geometry(const unsigned char *data, size_t len, int &cols, int &rows)
+{
+    std::unique_ptr<v2_header_t> h(new v2_header_t);
+    int ret = parse_header(data, len, *h);
+    cols = h->cols;
+    rows = h->rows;
+    return ret;
+}
+
+int v2_decode(const unsigned char *data, size_t len, frame_t &f, int threads)
+{
+    std::unique_ptr<v2_header_t> h(new v2_header_t);
+    if (parse_header(data, len, *h) < 0)
+        return -1;
+    int segments = h->segments;
+    std::atomic<int> failed(0);
+    auto decode_row = [&](int row) {
+        int ended;
+        if (v2_walk_row(*h, row,
+                        [&](short *zz, int quantval, int col) {
+                            reconstruct_block(*(quant_block_t *) zz, quantval,
+                                              f, row, col);
+                        },
+                        [](const unsigned char *, int) {}, ended) < 0)
+            failed = 1;
+    };
+
+    if (threads > segments)
+        threads = segments;
+    if (threads <= 1) {
+        for (int row = 0; row < segments; row++)
+            decode_row(row);
+    } else {
+        std::atomic<int> next_row(0);
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.push_back(std::thread([&]() {
+                int row;
+                while ((row = next_row++) < segments)
+                    decode_row(row);
+            }));
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+    }
+    return failed ? -1 : 0;
+}
+
+int v2_to_v1(const unsigned char *data, size_t len, std::vector<unsigned char> &out)
+{
+    std::unique_ptr<v2_header_t> h(new v2_header_t);
+    if (parse_header(data, len, *h) < 0)
+        return -1;
+    out.clear();
+    int ended = 0, clamped = 0;
+    for (unsigned long row = 0; row < h->segments && !ended; row++) {
+        if (v2_walk_row(*h, row,
+                        [&](short *zz, int quantval, int) {
+                            clamped += emit_block(out, zz, quantval);
+                        },
+                        [&](const unsigned char *payload, int n) {
+                            emit_skip(out, payload, n);
+                        }, ended) < 0)
+            return -1;
+        if (!ended)
+            emit_row_end(out);
+    }
+    emit_eof(out);
+    /* v2 magnitudes go up to 255, v1 ones only to 128. */
+    return clamped ? -1 : 0;
+}
+
+int is_v2(const unsigned char *data, size_t len)
+{
+    return len >= 4 && !memcmp(data, "VPG2", 4);
+}
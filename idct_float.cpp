@@ -0,0 +1,205 @@
+/*
+ * Single precision inverse transforms. Pixels are 8 bits and coefficients
+ * fit in a short, so float carries plenty of precision, and it doubles the
+ * lanes per instruction compared to block_t. The AVX-512 kernel keeps a
+ * whole 8x8 block in 4 zmm registers, two rows each.
+ *
+ * Neither path is used until transform_select() has compared it against
+ * the double reference, idct88(), on a corpus of blocks.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+// GCC 12 warns about the placeholder operand inside its own AVX-512
+// intrinsics once they are inlined into a target("avx512f") function, and
+// only says maybe under the sanitizers.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+
+#include "vpeg.h"
+
+int vpeg_transform = TRANSFORM_DOUBLE;
+
+typedef float fblock_t[8][8];
+
+#define CLAMP(val) ((val) < 0 ? 0 : ((val) > 255 ? 255 : (val)))
+
+// basis[n][k] is what coefficient n adds to sample k in idct(), including
+// its 2/8 scale and the halved DC term.
+static float basis[8][8];
+// The same rows twice over, one copy per half of a zmm register.
+static float basis_pair[8][16];
+// dequant() as a multiplier per raster position and level, DC excluded.
+static float dequant_scale[4][64];
+
+static void init_tables(void)
+{
+    for (int n = 0; n < 8; n++)
+        for (int k = 0; k < 8; k++)
+            basis[n][k] = basis_pair[n][k] = basis_pair[n][k + 8] =
+                (n ? cos(M_PI / 8 * n * (k + 0.5)) : 0.5) * (2 / 8.0);
+    for (int q = 0; q < 4; q++)
+        for (int i = 0; i < 64; i++)
+            dequant_scale[q][i] = quant_values[q][(i / 8 > 4) + (i % 8 > 4)] * 8;
+}
+
+// idct88() computes basis^T * m^T * basis: the rows, a transpose, then the
+// rows again. The same here, without moving anything around.
+__attribute__((target_clones("avx2", "default")))
+static void reconstruct_scalar(const quant_block_t &qb, int quantvalue,
+                               unsigned char *dst, int stride)
+{
+    fblock_t m, a;
+    const short *src = &qb[0][0];
+    float *mp = &m[0][0];
+    for (int i = 0; i < 64; i++)
+        mp[i] = src[i] * dequant_scale[quantvalue][i];
+    m[0][0] = 16384;
+    for (int i = 0; i < 8; i++)
+        for (int k = 0; k < 8; k++) {
+            float sum = 0;
+            for (int n = 0; n < 8; n++)
+                sum += m[i][n] * basis[n][k];
+            a[i][k] = sum;
+        }
+    for (int y = 0; y < 8; y++) {
+        float sum[8] = { 0 };
+        for (int i = 0; i < 8; i++)
+            for (int x = 0; x < 8; x++)
+                sum[x] += a[i][y] * basis[i][x];
+        for (int x = 0; x < 8; x++)
+            dst[x] = (unsigned char) CLAMP(sum[x]);
+        dst += stride;
+    }
+}
+
+// Permutation indices. Stage one needs element n of each row of a pair,
+// stage two element (row i, column 2j) in the low half and (i, 2j + 1) in
+// the high half, i.e. a column of the first stage's output per lane half.
+static int stage1_index[8][16], stage2_index[8][4][16];
+
+static void init_indices(void)
+{
+    for (int n = 0; n < 8; n++)
+        for (int l = 0; l < 16; l++)
+            stage1_index[n][l] = (l & 8) + n;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            for (int l = 0; l < 16; l++)
+                stage2_index[i][j][l] = (i & 1) * 8 + 2 * j + (l >> 3);
+}
+
+__attribute__((target("avx512f")))
+static void reconstruct_avx512(const quant_block_t &qb, int quantvalue,
+                               unsigned char *dst, int stride)
+{
+    __m512 b[8], m[4], a[4];
+    for (int n = 0; n < 8; n++)
+        b[n] = _mm512_loadu_ps(basis_pair[n]);
+    const short *src = &qb[0][0];
+    for (int r = 0; r < 4; r++) {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + 16 * r));
+        m[r] = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(s)),
+                             _mm512_loadu_ps(dequant_scale[quantvalue] + 16 * r));
+    }
+    m[0] = _mm512_mask_mov_ps(m[0], 1, _mm512_set1_ps(16384));
+
+    for (int r = 0; r < 4; r++) {
+        a[r] = _mm512_setzero_ps();
+        for (int n = 0; n < 8; n++) {
+            __m512i idx = _mm512_loadu_si512(stage1_index[n]);
+            a[r] = _mm512_fmadd_ps(_mm512_permutexvar_ps(idx, m[r]), b[n], a[r]);
+        }
+    }
+    for (int j = 0; j < 4; j++) {
+        __m512 sum = _mm512_setzero_ps();
+        for (int i = 0; i < 8; i++) {
+            __m512i idx = _mm512_loadu_si512(stage2_index[i][j]);
+            sum = _mm512_fmadd_ps(_mm512_permutexvar_ps(idx, a[i >> 1]), b[i], sum);
+        }
+        sum = _mm512_min_ps(_mm512_max_ps(sum, _mm512_setzero_ps()),
+                            _mm512_set1_ps(255));
+        __m128i px = _mm512_cvtusepi32_epi8(_mm512_cvttps_epu32(sum));
+        _mm_storel_epi64((__m128i *) dst, px);
+        _mm_storel_epi64((__m128i *) (dst + stride), _mm_unpackhi_epi64(px, px));
+        dst += 2 * stride;
+    }
+}
+
+void reconstruct_float(const quant_block_t &qb, int quantvalue,
+                       unsigned char *dst, int stride)
+{
+    if (vpeg_transform == TRANSFORM_AVX512)
+        reconstruct_avx512(qb, quantvalue, dst, stride);
+    else
+        reconstruct_scalar(qb, quantvalue, dst, stride);
+}
+
+const char *transform_name(int t)
+{
+    static const char *names[] = { "double", "float", "avx512" };
+    return t >= 0 && t <= TRANSFORM_AVX512 ? names[t] : "?";
+}
+
+// Largest pixel difference from the double path over random blocks of
+// every quantization level, from sparse up to every coefficient at the
+// largest magnitude a token can carry.
+static int transform_error(int t)
+{
+    unsigned long long s = 0x9e3779b97f4a7c15ULL;
+    int worst = 0;
+    for (int blk = 0; blk < 8192; blk++) {
+        quant_block_t zqb;
+        int quantvalue = blk & 3, density = 1 + (blk >> 2) % 64;
+        int range = (blk >> 8) & 1 ? 127 : 16;
+        short *c = &zqb[0][0];
+        for (int i = 0; i < 64; i++) {
+            s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+            unsigned r = (s * 0x2545f4914f6cdd1dULL) >> 32;
+            c[i] = r % 64 < (unsigned) density ? (int) ((r >> 8) % (2 * range + 1)) - range : 0;
+        }
+        unsigned char ref[64], got[64];
+        frame_t f = { 8, 8, 8, ref };
+        int saved = vpeg_transform;
+        vpeg_transform = TRANSFORM_DOUBLE;
+        reconstruct_block(zqb, quantvalue, f, 0, 0);
+        vpeg_transform = saved;
+        quant_block_t qb;
+        izigzag(zqb, qb);
+        if (t == TRANSFORM_AVX512)
+            reconstruct_avx512(qb, quantvalue, got, 8);
+        else
+            reconstruct_scalar(qb, quantvalue, got, 8);
+        for (int i = 0; i < 64; i++)
+            worst = std::max(worst, abs(ref[i] - got[i]));
+    }
+    return worst;
+}
+
+int transform_select(int want)
+{
+    init_tables();
+    init_indices();
+    vpeg_transform = TRANSFORM_DOUBLE;
+    if (want == TRANSFORM_AVX512 && !__builtin_cpu_supports("avx512f")) {
+        fprintf(stderr, "No AVX-512 on this CPU, trying float.\n");
+        want = TRANSFORM_FLOAT;
+    }
+    for (int t = want; t > TRANSFORM_DOUBLE; t--) {
+        int err = std::max(transform_error(t), engine_error());
+        if (err <= 1) {
+            vpeg_transform = t;
+            break;
+        }
+        fprintf(stderr, "The %s transform is off by %d, not using it.\n",
+                transform_name(t), err);
+    }
+    return vpeg_transform;
+}
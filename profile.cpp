@@ -0,0 +1,109 @@
+/*
+ * Counters behind profile.h. Every thread gets its own set so the hot path
+ * never shares a cache line; they are summed and printed as JSON at exit,
+ * to the file named by $VPEG_PROFILE or to stderr.
+ */
+
+#ifdef VPEG_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+#include "profile.h"
+
+static std::mutex prof_lock;
+static std::vector<prof_counters_t *> prof_threads;
+static thread_local prof_counters_t *prof_mine;
+
+static const char *stage_names[PROF_STAGES] = {
+    "parse", "zigzag", "dequant", "idct", "store", "deblock", "write"
+};
+
+static void prof_summary(void)
+{
+    prof_counters_t sum;
+    memset(&sum, 0, sizeof(sum));
+    {
+        std::lock_guard<std::mutex> guard(prof_lock);
+        for (size_t i = 0; i < prof_threads.size(); i++) {
+            unsigned long long *src = (unsigned long long *) prof_threads[i];
+            unsigned long long *dst = (unsigned long long *) &sum;
+            for (size_t j = 0; j < sizeof(sum) / sizeof(*dst); j++)
+                dst[j] += src[j];
+        }
+    }
+
+    const char *path = getenv("VPEG_PROFILE");
+    FILE *f = path ? fopen(path, "w") : NULL;
+    if (!f)
+        f = stderr;
+    double blocks = sum.blocks ? sum.blocks : 1;
+    fprintf(f, "{\n  \"images\": %llu,\n  \"blocks\": %llu,\n",
+            sum.images, sum.blocks);
+    fprintf(f, "  \"cycles_per_image\": %.0f,\n",
+            sum.images ? (double) sum.image_cycles / sum.images : 0.0);
+    fprintf(f, "  \"stages\": {");
+    for (int s = 0; s < PROF_STAGES; s++)
+        fprintf(f, "%s\n    \"%s\": { \"cycles\": %llu, \"per_block\": %.1f }",
+                s ? "," : "", stage_names[s], sum.cycles[s],
+                sum.cycles[s] / blocks);
+    fprintf(f, "\n  },\n  \"tokens\": { \"coefficients\": %llu, \"runs\": %llu, "
+            "\"skip_records\": %llu, \"skip_bytes\": %llu },\n",
+            sum.coefficients, sum.runs, sum.skip_records, sum.skip_bytes);
+    fprintf(f, "  \"coefficients_per_block\": [");
+    for (int i = 0; i <= 64; i++)
+        fprintf(f, "%s%llu", i ? ", " : "", sum.coefs_per_block[i]);
+    fprintf(f, "],\n  \"block_cycles_log2\": [");
+    int top = 63;
+    while (top > 0 && !sum.block_cycles_log2[top])
+        top--;
+    for (int i = 0; i <= top; i++)
+        fprintf(f, "%s%llu", i ? ", " : "", sum.block_cycles_log2[i]);
+    fprintf(f, "]\n}\n");
+    if (f != stderr)
+        fclose(f);
+}
+
+prof_counters_t *prof_local(void)
+{
+    if (!prof_mine) {
+        /* Never freed: the summary runs after worker threads are gone. */
+        prof_mine = new prof_counters_t();
+        std::lock_guard<std::mutex> guard(prof_lock);
+        if (prof_threads.empty())
+            atexit(prof_summary);
+        prof_threads.push_back(prof_mine);
+    }
+    return prof_mine;
+}
+
+void prof_block(int coefs, unsigned long long start)
+{
+    prof_counters_t *p = prof_local();
+    unsigned long long cycles = __rdtsc() - start;
+    p->blocks++;
+    p->coefs_per_block[coefs]++;
+    p->block_cycles_log2[cycles ? 63 - __builtin_clzll(cycles) : 0]++;
+}
+
+// Nonzero coefficients in a block of count, for prof_block(). Blocks of
+// more than 64 share the last bucket.
+int prof_coefficients(const short *zz, int count)
+{
+    int coefs = 0;
+    for (int i = 0; i < count; i++)
+        coefs += zz[i] != 0;
+    return coefs > 64 ? 64 : coefs;
+}
+
+void prof_image(unsigned long long start)
+{
+    prof_counters_t *p = prof_local();
+    p->images++;
+    p->image_cycles += __rdtsc() - start;
+}
+
+#endif
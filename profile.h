@@ -0,0 +1,56 @@
+/*
+ * Opt-in hot-path instrumentation. Build with -DVPEG_PROFILE (make
+ * PROFILE=1) to count TSC cycles per decode stage and the tokens the v1
+ * block parsers see; without it every macro below expands to nothing.
+ *
+ * Every v1 decode path is covered: irle() for trusted 8x8 streams and
+ * parse_block() for the checked, other block size and tiled paths. For
+ * those last two the "idct" stage holds dequantization and the store as
+ * well, as for the float transforms. The v2 Huffman decoder is not
+ * instrumented, its pictures do not show up at all.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+enum prof_stage_t {
+    PROF_PARSE, PROF_ZIGZAG, PROF_DEQUANT, PROF_IDCT, PROF_STORE, PROF_DEBLOCK,
+    PROF_WRITE, PROF_STAGES
+};
+
+#ifdef VPEG_PROFILE
+
+#include <x86intrin.h>
+
+// Per-thread counters, summed into the JSON summary at exit.
+struct prof_counters_t {
+    unsigned long long cycles[PROF_STAGES];
+    unsigned long long blocks, images, image_cycles;
+    unsigned long long coefficients, runs, skip_records, skip_bytes;
+    unsigned long long coefs_per_block[65];
+    unsigned long long block_cycles_log2[64];
+};
+
+prof_counters_t *prof_local(void);
+
+#define PROF_START() unsigned long long prof_t = __rdtsc()
+#define PROF_STAGE(s) do { unsigned long long prof_now = __rdtsc(); \
+        prof_local()->cycles[s] += prof_now - prof_t; prof_t = prof_now; } while (0)
+#define PROF_COUNT(field, n) (prof_local()->field += (n))
+#define PROF_BLOCK(coefs, start) prof_block(coefs, start)
+#define PROF_IMAGE(start) prof_image(start)
+
+void prof_block(int coefs, unsigned long long start);
+int prof_coefficients(const short *zz, int count);
+void prof_image(unsigned long long start);
+
+#else
+
+#define PROF_START() do { } while (0)
+#define PROF_STAGE(s) do { } while (0)
+#define PROF_COUNT(field, n) do { } while (0)
+#define PROF_BLOCK(coefs, start) do { } while (0)
+#define PROF_IMAGE(start) do { } while (0)
+
+#endif
+
+#endif
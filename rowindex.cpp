@@ -0,0 +1,188 @@
+/*
+ * Row index carried inside the stream, in skip records that every decoder
+ * already steps over with CHECKSKIP. The records sit right after the block
+ * size header, if any, before the first block. Each payload starts with
+ * "VPEGIDX" and a kind byte, then little-endian numbers:
+ *
+ *   'R'  rows, cols, first row, then the offset of up to 58 rows from
+ *        first on, each the byte just after the previous row marker
+ *
+ * Offsets are absolute and include the index itself. A decoder that finds
+ * offsets for every row can start all rows at once without scanning the
+ * stream first. Nothing in the index is trusted: the geometry is held to
+ * VPEG_MAX_PIXELS before anything is allocated, and each row is still
+ * checked to run from its offset exactly to the next one, the last to the
+ * 0xaf, and to hold cols blocks before they are decoded, see
+ * check_embedded_row().
+ */
+
+#include <string.h>
+
+#include "vpeg.h"
+
+static const char index_magic[7] = { 'V', 'P', 'E', 'G', 'I', 'D', 'X' };
+
+#define ROWS_PER_RECORD 58
+
+static void put32(std::vector<unsigned char> &out, unsigned long v)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back((v >> (8 * i)) & 0xff);
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+static void start_record(std::vector<unsigned char> &payload, char kind)
+{
+    payload.assign(index_magic, index_magic + sizeof(index_magic));
+    payload.push_back(kind);
+}
+
+int is_row_index_record(const unsigned char *payload, int len)
+{
+    return len >= 8 && !memcmp(payload, index_magic, sizeof(index_magic));
+}
+
+void emit_row_index(std::vector<unsigned char> &out, int rows, int cols,
+                    const std::vector<size_t> &offsets)
+{
+    std::vector<unsigned char> payload;
+    for (int first = 0; first < rows; first += ROWS_PER_RECORD) {
+        start_record(payload, 'R');
+        put32(payload, rows);
+        put32(payload, cols);
+        put32(payload, first);
+        for (int row = first; row < rows && row < first + ROWS_PER_RECORD; row++)
+            put32(payload, offsets[row]);
+        emit_skip(out, payload.data(), payload.size());
+    }
+}
+
+// Bytes the index records for rows rows take.
+static size_t index_size(int rows)
+{
+    size_t records = (rows + ROWS_PER_RECORD - 1) / ROWS_PER_RECORD;
+    return records * (2 + 8 + 12) + (size_t) rows * 4;
+}
+
+// Length of what stays in front of the index at the start of a stream:
+// the block size header and skip records that are not an index. It is
+// copied to strip, if given, with the leading index records left out.
+static size_t leading_records(const unsigned char *data, size_t len,
+                              std::vector<unsigned char> *strip)
+{
+    size_t p = stream_start(data, len);
+    if (strip)
+        strip->insert(strip->end(), data, data + p);
+    while (p + 1 < len && data[p] == 0xff && p + 2 + data[p + 1] <= len) {
+        int n = data[p + 1];
+        if (!is_row_index_record(data + p + 2, n) && strip)
+            strip->insert(strip->end(), data + p, data + p + 2 + n);
+        p += 2 + n;
+    }
+    return p;
+}
+
+int vpeg_strip_index(const unsigned char *data, size_t len,
+                     std::vector<unsigned char> &out)
+{
+    out.clear();
+    size_t p = leading_records(data, len, &out);
+    out.insert(out.end(), data + p, data + len);
+    return 0;
+}
+
+int vpeg_embed_index(const unsigned char *data, size_t len,
+                     std::vector<unsigned char> &out)
+{
+    std::vector<unsigned char> s;
+    vpeg_strip_index(data, len, s);
+    stream_index_t idx;
+    /* Short rows would never pass check_embedded_row(). */
+    if (vpeg_index(s.data(), s.size(), idx) < 0 ||
+        idx.blocks != (long) idx.rows * idx.cols)
+        return -1;
+
+    /* Everything after the leading records moves up by the index size. */
+    size_t head = leading_records(s.data(), s.size(), NULL);
+    size_t shift = index_size(idx.rows);
+    if (s.size() + shift > 0xffffffffUL || idx.rows > 0xffff || idx.cols > 0xffff ||
+        (long) idx.rows * idx.cols * idx.block_size * idx.block_size > VPEG_MAX_PIXELS)
+        return -1;
+    std::vector<size_t> offsets(idx.row_offset);
+    for (int row = 0; row < idx.rows; row++)
+        offsets[row] = (offsets[row] < head ? head : offsets[row]) + shift;
+
+    out.assign(s.begin(), s.begin() + head);
+    emit_row_index(out, idx.rows, idx.cols, offsets);
+    out.insert(out.end(), s.begin() + head, s.end());
+    return 0;
+}
+
+int vpeg_embedded_index(const unsigned char *data, size_t len,
+                        stream_index_t &idx)
+{
+    int n = parse_block_size(data, len);
+    if (n < 0 || len == 0 || data[len - 1] != 0xaf)
+        return -1;
+    idx.rows = idx.cols = -1;
+    idx.row_offset.clear();
+    size_t filled = 0, head = leading_records(data, len, NULL);
+    for (size_t p = stream_start(data, len); p < head; p += 2 + data[p + 1]) {
+        const unsigned char *r = data + p + 2;
+        int size = data[p + 1];
+        if (!is_row_index_record(r, size))
+            continue;
+        if (r[7] != 'R' || size < 20)
+            continue;
+        long rows = get32(r + 8), cols = get32(r + 12), first = get32(r + 16);
+        if (idx.rows < 0) {
+            if (rows <= 0 || rows > 0xffff || cols <= 0 || cols > 0xffff ||
+                rows * cols * n * n > VPEG_MAX_PIXELS)
+                return -1;
+            idx.rows = rows;
+            idx.cols = cols;
+            idx.row_offset.assign(rows, 0);
+        }
+        if (rows != idx.rows || cols != idx.cols)
+            return -1;
+        for (int i = 20; i + 4 <= size && first < rows; i += 4, first++) {
+            if (idx.row_offset[first])
+                return -1;
+            idx.row_offset[first] = get32(r + i);
+            filled++;
+        }
+    }
+    if (idx.rows < 0 || filled != (size_t) idx.rows)
+        return -1;
+    /* Rows in order, and inside the stream past the index. */
+    for (int row = 0; row < idx.rows; row++)
+        if (idx.row_offset[row] < (row ? idx.row_offset[row - 1] + 1 : head) ||
+            idx.row_offset[row] >= len)
+            return -1;
+    idx.block_size = n;
+    idx.trusted = 0;
+    idx.embedded = 1;
+    idx.blocks = (long) idx.rows * idx.cols;
+    idx.end = len - 1;
+    return 0;
+}
+
+int check_embedded_row(const unsigned char *data, const stream_index_t &idx,
+                       int row)
+{
+    size_t limit = row + 1 < idx.rows ? idx.row_offset[row + 1] : idx.end + 1;
+    size_t end;
+    int blocks = 0, overflow = 0;
+    int n = idx.block_size;
+    int ret = scan_row(data, limit, idx.row_offset[row], n * n, end, blocks,
+                       overflow);
+    if (ret <= 0 || blocks != idx.cols)
+        return -1;
+    if (row + 1 < idx.rows ? ret != 1 || end != limit : end != idx.end)
+        return -1;
+    return !overflow;
+}
@@ -0,0 +1,230 @@
+/*
+ * Multi-frame VPEG sequences with conditional block replenishment.
+ *
+ * A sequence starts with a skip record holding the magic "VPEGSEQ1" and the
+ * geometry in blocks (16-bit big-endian columns, then rows), so decoders
+ * that do not know about sequences decode the first frame as a plain
+ * picture. Frames follow back to back, each terminated by 0xaf. The first
+ * frame is a complete picture; later frames may also use
+ *
+ * 0b10101101 0bnnnnnnnn:            the next nnnnnnnn+1 blocks are unchanged
+ *
+ * and a row or frame may end early, in which case the rest of it is
+ * unchanged as well. A frame that changes nothing is just 0xaf.
+ */
+
+#include <string.h>
+
+#include "vpeg.h"
+
+static const char seq_magic[8] = { 'V', 'P', 'E', 'G', 'S', 'E', 'Q', '1' };
+
+void seq_encoder_init(seq_encoder_t &s, int width, int height, int quantval)
+{
+    s.width = width;
+    s.height = height;
+    s.cols = (width + 7) / 8;
+    s.rows = (height + 7) / 8;
+    s.quantval = quantval;
+    s.frames = 0;
+    s.coefs.assign((size_t) s.cols * s.rows * 64, 0);
+    s.pixels.assign((size_t) width * height, 0);
+}
+
+// Compares the pixels of block (row, col) with the previous frame and
+// stores the new ones. Identical pixels mean identical coefficients, so
+// static blocks never reach the forward DCT. f has the size of the first
+// frame, seq_encode_frame() makes sure of that.
+static int block_same(seq_encoder_t &s, const frame_t &f, int row, int col)
+{
+    int same = 1;
+    int w = s.width - col * 8 < 8 ? s.width - col * 8 : 8;
+    int h = s.height - row * 8 < 8 ? s.height - row * 8 : 8;
+    for (int y = 0; y < h; y++) {
+        const unsigned char *src = f.pixels + (size_t) (row * 8 + y) * f.stride + col * 8;
+        unsigned char *prev = &s.pixels[(size_t) (row * 8 + y) * s.width + col * 8];
+        if (memcmp(prev, src, w)) {
+            memcpy(prev, src, w);
+            same = 0;
+        }
+    }
+    return same;
+}
+
+// Blocks are compared on their quantized coefficients, so a skipped block
+// decodes to exactly what re-sending it would have produced and errors
+// never accumulate over a sequence. Every frame must have the size given
+// to seq_encoder_init(); returns -1 and writes nothing otherwise.
+int seq_encode_frame(seq_encoder_t &s, const frame_t &f,
+                     std::vector<unsigned char> &out)
+{
+    if (f.width != s.width || f.height != s.height)
+        return -1;
+    if (s.frames == 0) {
+        unsigned char header[12];
+        memcpy(header, seq_magic, 8);
+        header[8] = s.cols >> 8;
+        header[9] = s.cols & 0xff;
+        header[10] = s.rows >> 8;
+        header[11] = s.rows & 0xff;
+        emit_skip(out, header, sizeof(header));
+    }
+
+    /* Rows that change nothing are only written as far as needed: trailing
+       unchanged blocks, rows and finally the frame end early. */
+    size_t frame_start = out.size();
+    size_t last_change = out.size();
+    for (int row = 0; row < s.rows; row++) {
+        int unchanged = 0;
+        for (int col = 0; col < s.cols; col++) {
+            quant_block_t qm, zz;
+            short *prev = &s.coefs[((size_t) row * s.cols + col) * 64];
+            if (block_same(s, f, row, col) && s.frames > 0) {
+                unchanged++;
+                continue;
+            }
+            encode_coefficients(f, row, col, s.quantval, qm);
+            zigzag(qm, zz);
+            if (s.frames > 0 && !memcmp(prev, zz, sizeof(zz))) {
+                unchanged++;
+                continue;
+            }
+            while (unchanged > 0) {
+                int n = unchanged > 256 ? 256 : unchanged;
+                out.push_back(0xad);
+                out.push_back(n - 1);
+                unchanged -= n;
+            }
+            memcpy(prev, zz, sizeof(zz));
+            emit_block(out, &zz[0][0], s.quantval);
+            last_change = out.size();
+        }
+        emit_row_end(out);
+    }
+    if (s.frames > 0)
+        out.resize(last_change > frame_start ? last_change : frame_start);
+    emit_eof(out);
+    s.frames++;
+    return 0;
+}
+
+int is_sequence_record(const unsigned char *payload, int len)
+{
+    return len == 12 && !memcmp(payload, seq_magic, sizeof(seq_magic));
+}
+
+int seq_decoder_init(seq_decoder_t &s, unsigned char *&bitstream, size_t len)
+{
+    if (len < 14 || bitstream[0] != 0xff ||
+        !is_sequence_record(bitstream + 2, bitstream[1]))
+        return -1;
+    s.cols = (bitstream[10] << 8) | bitstream[11];
+    s.rows = (bitstream[12] << 8) | bitstream[13];
+    if (!s.cols || !s.rows || (long) s.cols * s.rows * 64 > VPEG_MAX_PIXELS)
+        return -1;
+    s.frames = 0;
+    if (frame_alloc(s.frame, s.cols * 8, s.rows * 8) < 0)
+        return -1;
+    bitstream += 14;
+    return 0;
+}
+
+// Walks one frame from p without decoding it, checking what decode_block()
+// does not: that every token fits before end, every block is a block
+// header with at most 64 coefficients, and blocks, skips and rows stay
+// inside the geometry of the sequence. Returns the end of the frame, just
+// past its 0xaf, or NULL.
+static const unsigned char *scan_frame(const seq_decoder_t &s,
+                                       const unsigned char *p,
+                                       const unsigned char *end)
+{
+    int row = 0, col = 0;
+    while (1) {
+        if (p >= end)
+            return NULL;
+        unsigned char b = *p;
+        if (b == 0xff) {
+            if (end - p < 2 || end - p - 2 < p[1])
+                return NULL;
+            p += p[1] + 2;
+        } else if (b == 0xaf) {
+            return p + 1;
+        } else if (b == 0xae) {
+            if (++row > s.rows)
+                return NULL;
+            col = 0;
+            p++;
+        } else if (b == 0xad) {
+            if (end - p < 2 || (col += p[1] + 1) > s.cols)
+                return NULL;
+            p += 2;
+        } else if ((b & 0xfc) == 0xa0) {
+            if (row >= s.rows || col >= s.cols)
+                return NULL;
+            int pos = 1;
+            p += 3;
+            while (1) {
+                if (p >= end)
+                    return NULL;
+                b = *p;
+                if (b == 0xac) {
+                    p++;
+                    break;
+                } else if (b == 0xff) {
+                    if (end - p < 2 || end - p - 2 < p[1])
+                        return NULL;
+                    p += p[1] + 2;
+                } else if (!(b & 0x80)) {
+                    p++;
+                    pos++;
+                } else if ((b & 0xe0) == 0x80) {
+                    p += 2;
+                    pos += ((b & 0x1e) >> 1) + 1;
+                } else {
+                    return NULL;
+                }
+            }
+            if (pos > 64)
+                return NULL;
+            col++;
+        } else {
+            return NULL;
+        }
+    }
+}
+
+// Decodes one frame into s.frame in place. Only the blocks listed in
+// s.dirty were written; everything else still holds the previous frame.
+// The frame is checked by scan_frame() first, so decode_block() only ever
+// sees tokens that fit.
+int seq_decode_frame(seq_decoder_t &s, unsigned char *&bitstream,
+                     const unsigned char *end)
+{
+    int row = 0, col = 0;
+
+    s.dirty.clear();
+    if (bitstream >= end)
+        return 0;
+    if (!scan_frame(s, bitstream, end))
+        return -1;
+    while (1) {
+        CHECKSKIP;
+        if (*bitstream == 0xaf) {
+            bitstream++;
+            break;
+        } else if (*bitstream == 0xae) {
+            bitstream++;
+            row++;
+            col = 0;
+        } else if (*bitstream == 0xad) {
+            col += bitstream[1] + 1;
+            bitstream += 2;
+        } else {
+            decode_block(bitstream, s.frame, row, col);
+            s.dirty.push_back(row * s.cols + col);
+            col++;
+        }
+    }
+    s.frames++;
+    return 1;
+}
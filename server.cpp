@@ -0,0 +1,498 @@
+/*
+ * Long-running decode service on a Unix domain socket.
+ *
+ * Requests are single lines, answered in order on the same connection:
+ *
+ *   DECODE <path> [FD]      decode a file the server can read
+ *   DATA <length> [FD]      decode the <length> stream bytes that follow
+ *   STATS                   request count and latency percentiles
+ *
+ * A decode is answered with "OK <width> <height>" and the pixels, row by
+ * row. With FD the pixels are instead put in a memfd that comes along with
+ * the reply line as SCM_RIGHTS ancillary data, for the client to mmap.
+ * Failures are answered with "ERR <reason>". A DATA stream longer than
+ * DATA_MAX is refused and the connection closed, as the bytes that follow
+ * cannot be told from the next request.
+ *
+ * Workers take requests, not connections: between requests a connection
+ * sits in the acceptor's poll() set, which reads what arrives and hands
+ * the connection to a worker once a whole request line is in, so idle or
+ * slow clients hold no worker. The worker answers every complete line
+ * and hands the connection back. Connections that send nothing for
+ * IDLE_TIMEOUT seconds are closed. Only a DATA payload is read by the
+ * worker itself, and a client that stalls for STALL_TIMEOUT seconds in
+ * one, or in reading a reply, is closed as well.
+ *
+ * The index of every file decoded by path is kept, keyed by the file's
+ * identity and modification time, so decoding an unchanged file again
+ * starts right at the rows. A file can change without its time stamp, so
+ * the entry also holds a hash of the bytes, which are hashed again on
+ * every hit; hashing runs several times faster than a scan. A file whose
+ * hash differs is scanned again.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "vpeg.h"
+
+#define DATA_MAX (64 << 20)
+#define IDLE_TIMEOUT 30
+#define STALL_TIMEOUT 5
+
+struct conn_t;
+
+// Connections with a request to answer, for the workers.
+static std::mutex queue_lock;
+static std::condition_variable queue_ready;
+static std::deque<conn_t *> pending;
+
+// Connections the workers are done with, for the acceptor to watch again;
+// a byte on wake_pipe tells it there are some.
+static std::mutex returned_lock;
+static std::vector<conn_t *> returned;
+static int wake_pipe[2];
+
+// Latencies of the most recent requests, in microseconds.
+static std::mutex stats_lock;
+static std::vector<double> latencies(65536);
+static unsigned long long requests, failures, index_hits;
+
+struct cached_index_t {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned long long hash;
+    stream_index_t idx;
+};
+
+#define INDEX_CACHE_MAX 1024
+
+static std::mutex cache_lock;
+static std::map<std::string, cached_index_t> index_cache;
+
+static int same_file(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+           a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+// FNV-1a, eight bytes at a time.
+static unsigned long long content_hash(const std::vector<unsigned char> &data)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL, word;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        memcpy(&word, &data[i], 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < data.size(); i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static int cache_lookup(const char *path, const struct stat &st,
+                        unsigned long long hash, stream_index_t &idx)
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    auto it = index_cache.find(path);
+    if (it == index_cache.end())
+        return 0;
+    const cached_index_t &e = it->second;
+    if (e.dev != st.st_dev || e.ino != st.st_ino || e.size != st.st_size ||
+        e.mtime.tv_sec != st.st_mtim.tv_sec || e.mtime.tv_nsec != st.st_mtim.tv_nsec ||
+        e.hash != hash)
+        return 0;
+    idx = e.idx;
+    index_hits++;
+    return 1;
+}
+
+static void cache_store(const char *path, const struct stat &st,
+                        unsigned long long hash, const stream_index_t &idx)
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    if (index_cache.size() >= INDEX_CACHE_MAX)
+        index_cache.clear();
+    cached_index_t &e = index_cache[path];
+    e.dev = st.st_dev;
+    e.ino = st.st_ino;
+    e.size = st.st_size;
+    e.mtime = st.st_mtim;
+    e.hash = hash;
+    e.idx = idx;
+}
+
+// Buffered reads from a connection.
+struct conn_t {
+    int fd;
+    unsigned char buf[4096];
+    size_t pos, len;
+    double last;                // when it last sent or was answered
+};
+
+static int conn_getc(conn_t &c)
+{
+    if (c.pos == c.len) {
+        ssize_t n = read(c.fd, c.buf, sizeof(c.buf));
+        if (n <= 0)
+            return -1;
+        c.pos = 0;
+        c.len = n;
+    }
+    return c.buf[c.pos++];
+}
+
+static int conn_line(conn_t &c, char *line, size_t size)
+{
+    size_t n = 0;
+    int ch;
+    while ((ch = conn_getc(c)) != '\n') {
+        if (ch < 0 || n + 1 >= size)
+            return -1;
+        line[n++] = ch;
+    }
+    line[n] = 0;
+    return n;
+}
+
+static int conn_read(conn_t &c, unsigned char *dst, size_t len)
+{
+    size_t n = std::min(len, c.len - c.pos);
+    memcpy(dst, c.buf + c.pos, n);
+    c.pos += n;
+    while (n < len) {
+        ssize_t r = read(c.fd, dst + n, len - n);
+        if (r <= 0)
+            return -1;
+        n += r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int reply(int fd, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    return write_all(fd, line, n);
+}
+
+// Sends the reply line with a descriptor attached.
+static int reply_fd(int fd, const char *line, int passed)
+{
+    struct iovec iov = { (void *) line, strlen(line) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passed, sizeof(int));
+    return sendmsg(fd, &msg, 0) == (ssize_t) iov.iov_len ? 0 : -1;
+}
+
+static void record(double seconds, int ok)
+{
+    std::lock_guard<std::mutex> guard(stats_lock);
+    latencies[requests % latencies.size()] = seconds * 1e6;
+    requests++;
+    failures += !ok;
+}
+
+static int reply_stats(int fd)
+{
+    std::vector<double> sorted;
+    unsigned long long n, failed, hits;
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        hits = index_hits;
+    }
+    {
+        std::lock_guard<std::mutex> guard(stats_lock);
+        n = requests;
+        failed = failures;
+        sorted.assign(latencies.begin(),
+                      latencies.begin() + std::min<size_t>(n, latencies.size()));
+    }
+    std::sort(sorted.begin(), sorted.end());
+#define PERCENTILE(p) (sorted.empty() ? 0 : sorted[(size_t) ((sorted.size() - 1) * (p))])
+    return reply(fd, "OK requests=%llu failures=%llu p50_us=%.0f p90_us=%.0f "
+                 "p99_us=%.0f max_us=%.0f index_hits=%llu\n", n, failed,
+                 PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99),
+                 PERCENTILE(1.0), hits);
+}
+
+// State a worker keeps between requests, so steady-state decoding does not
+// allocate.
+struct worker_t {
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> pixels;
+    stream_index_t idx;
+};
+
+// With indexed set, w.idx is a cached index of these very bytes. Otherwise
+// w.idx is the fresh scan.
+static int decode_request(worker_t &w, conn_t &c, int use_fd, int indexed)
+{
+    if (!indexed && vpeg_index(w.input.data(), w.input.size(), w.idx) < 0)
+        return reply(c.fd, "ERR malformed stream\n") < 0 ? -1 : 1;
+    if ((long) w.idx.cols * w.idx.rows * w.idx.block_size * w.idx.block_size >
+        VPEG_MAX_PIXELS)
+        return reply(c.fd, "ERR picture too large\n") < 0 ? -1 : 1;
+
+    frame_t f;
+    f.width = f.stride = w.idx.cols * w.idx.block_size;
+    f.height = w.idx.rows * w.idx.block_size;
+    size_t size = (size_t) f.width * f.height;
+    if (w.pixels.size() < size)
+        w.pixels.resize(size);
+    f.pixels = w.pixels.data();
+    memset(f.pixels, 0, size);
+    vpeg_decode_indexed(w.input.data(), w.idx, f, 1);
+
+    char line[64];
+    snprintf(line, sizeof(line), "OK %d %d\n", f.width, f.height);
+    if (!use_fd) {
+        if (write_all(c.fd, line, strlen(line)) < 0 ||
+            write_all(c.fd, f.pixels, size) < 0)
+            return -1;
+        return 0;
+    }
+    int mfd = memfd_create("vpeg-frame", MFD_CLOEXEC);
+    if (mfd < 0 || write_all(mfd, f.pixels, size) < 0) {
+        if (mfd >= 0)
+            close(mfd);
+        return reply(c.fd, "ERR memfd\n") < 0 ? -1 : 1;
+    }
+    int ret = reply_fd(c.fd, line, mfd);
+    close(mfd);
+    return ret;
+}
+
+// Answers one request. Returns -1 if the connection has to be closed.
+static int serve_request(worker_t &w, conn_t &c)
+{
+    char line[4096];
+    if (conn_line(c, line, sizeof(line)) < 0)
+        return -1;
+    double t0 = now_seconds();
+    char arg[4096], flag[8] = "";
+    int ret;
+    if (!strcmp(line, "STATS")) {
+        return reply_stats(c.fd) < 0 ? -1 : 0;
+    } else if (sscanf(line, "DECODE %4095s %7s", arg, flag) >= 1) {
+        /* The cached index is only trusted if the file did not change
+           while it was read. */
+        struct stat before, after;
+        if (stat(arg, &before) < 0 || read_file(arg, w.input) < 0 ||
+            stat(arg, &after) < 0) {
+            ret = reply(c.fd, "ERR cannot read %s\n", arg) < 0 ? -1 : 1;
+        } else {
+            int unchanged = same_file(before, after) &&
+                            w.input.size() == (size_t) after.st_size;
+            unsigned long long hash = unchanged ? content_hash(w.input) : 0;
+            int indexed = unchanged && cache_lookup(arg, after, hash, w.idx);
+            ret = decode_request(w, c, !strcmp(flag, "FD"), indexed);
+            if (ret == 0 && unchanged && !indexed)
+                cache_store(arg, after, hash, w.idx);
+        }
+    } else if (sscanf(line, "DATA %4095s %7s", arg, flag) >= 1) {
+        size_t len = strtoul(arg, NULL, 10);
+        if (len > DATA_MAX) {
+            reply(c.fd, "ERR stream too large\n");
+            record(now_seconds() - t0, 0);
+            return -1;
+        }
+        w.input.resize(len);
+        if (conn_read(c, w.input.data(), len) < 0)
+            return -1;
+        ret = decode_request(w, c, !strcmp(flag, "FD"), 0);
+    } else {
+        ret = reply(c.fd, "ERR unknown request\n") < 0 ? -1 : 1;
+    }
+    record(now_seconds() - t0, ret == 0);
+    return ret < 0 ? -1 : 0;
+}
+
+static void worker_main(void)
+{
+    worker_t w;
+    while (1) {
+        conn_t *c;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_ready.wait(guard, [] { return !pending.empty(); });
+            c = pending.front();
+            pending.pop_front();
+        }
+        /* Lines already buffered would never wake poll(); the start of
+           the next one stays for the acceptor to complete. */
+        int ret;
+        do
+            ret = serve_request(w, *c);
+        while (ret == 0 && memchr(c->buf + c->pos, '\n', c->len - c->pos));
+        if (ret < 0) {
+            close(c->fd);
+            delete c;
+            continue;
+        }
+        memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+        c->last = now_seconds();
+        {
+            std::lock_guard<std::mutex> guard(returned_lock);
+            returned.push_back(c);
+        }
+        char wake = 0;
+        if (write(wake_pipe[1], &wake, 1) < 0 && errno != EAGAIN)
+            perror("wake");
+    }
+}
+
+int vpeg_serve(const char *path, int workers)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0)
+        return -1;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        return -1;
+
+    if (workers < 1)
+        workers = 1;
+    for (int i = 0; i < workers; i++)
+        std::thread(worker_main).detach();
+    printf("Serving on %s with %d workers.\n", path, workers);
+    fflush(stdout);
+
+    /* Watches the listening socket, the wake pipe and every connection
+       between requests. */
+    std::vector<conn_t *> idle, still;
+    std::vector<struct pollfd> fds;
+    while (1) {
+        fds.resize(2 + idle.size());
+        fds[0] = { fd, POLLIN, 0 };
+        fds[1] = { wake_pipe[0], POLLIN, 0 };
+        for (size_t i = 0; i < idle.size(); i++)
+            fds[2 + i] = { idle[i]->fd, POLLIN, 0 };
+        if (poll(fds.data(), fds.size(), 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /* A whole line goes to a worker, a hang up or a line too long
+           for the buffer closes, and so does being quiet too long. */
+        double now = now_seconds();
+        still.clear();
+        for (size_t i = 0; i < idle.size(); i++) {
+            conn_t *c = idle[i];
+            if (fds[2 + i].revents) {
+                ssize_t n = c->len < sizeof(c->buf) ?
+                            read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len) : 0;
+                if (n <= 0) {
+                    close(c->fd);
+                    delete c;
+                    continue;
+                }
+                c->len += n;
+                c->last = now;
+                if (memchr(c->buf, '\n', c->len)) {
+                    std::lock_guard<std::mutex> guard(queue_lock);
+                    pending.push_back(c);
+                    queue_ready.notify_one();
+                } else {
+                    still.push_back(c);
+                }
+            } else if (now - c->last > IDLE_TIMEOUT) {
+                close(c->fd);
+                delete c;
+            } else {
+                still.push_back(c);
+            }
+        }
+        idle.swap(still);
+
+        if (fds[1].revents & POLLIN) {
+            char drain[256];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            std::lock_guard<std::mutex> guard(returned_lock);
+            idle.insert(idle.end(), returned.begin(), returned.end());
+            returned.clear();
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                return -1;
+            }
+            struct timeval stall = { STALL_TIMEOUT, 0 };
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+            setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+            conn_t *c = new conn_t;
+            c->fd = conn;
+            c->pos = c->len = 0;
+            c->last = now;
+            idle.push_back(c);
+        }
+    }
+}
@@ -0,0 +1,242 @@
+/*
+ * vpeg_index() in parallel, for streams without an embedded index. The
+ * input is cut into one byte range per thread. Every range but the first
+ * guesses where a block starts near its beginning and scans from there
+ * as if the guess were right. Stitching then walks the ranges in order,
+ * carrying on from where the previous range's scan left off: if that
+ * reaches the guess, the range was right, if it steps over it, the range
+ * is scanned again from the true position.
+ *
+ * A guess is a block header, 0xa0-0xa3, right after an end of block or
+ * row marker, that parses on for a few blocks. A header right behind a
+ * skip record is never guessed, the true scan just walks on to the next
+ * one. Bytes inside skip records or coefficients can look like a header
+ * too; that only costs a rescan, since a guess is only taken once the
+ * true scan has reached it.
+ */
+
+#include <thread>
+
+#include "vpeg.h"
+
+// Blocks a guess has to parse cleanly before a range scans from it.
+#define RESYNC_BLOCKS 4
+
+// What one range contributes to the index.
+struct span_t {
+    size_t start;               // where the scan began
+    size_t exit;                // first block header past the range, or 0xaf
+    int status;                 // 0 at exit, 1 at the end of file, -1 broken
+    int overflow;               // a block had more than n * n coefficients
+    long blocks;
+    std::vector<size_t> rows;   // offset just past each row marker
+    std::vector<int> widths;    // blocks before the first marker, then after each
+};
+
+// Walks the block at p, the header included, and returns the offset past
+// it, or 0 if it runs off the end or holds something that is not a token.
+static size_t walk_block(const unsigned char *data, size_t len, size_t p,
+                         int &pos)
+{
+    pos = 1;
+    p += 3;
+    while (1) {
+        if (p >= len)
+            return 0;
+        unsigned char b = data[p];
+        if (b == 0xac) {
+            return p + 1;
+        } else if (b == 0xff) {
+            if (p + 1 >= len || p + 2 + data[p + 1] > len)
+                return 0;
+            p += data[p + 1] + 2;
+        } else if (!(b & 0x80)) {
+            p++;
+            pos++;
+        } else if ((b & 0xe0) == 0x80) {
+            p += 2;
+            pos += ((b & 0x1e) >> 1) + 1;
+        } else {
+            return 0;
+        }
+    }
+}
+
+// The scan of vpeg_index(), from p until the first block header at or
+// past stop.
+static void scan_span(const unsigned char *data, size_t len, size_t p,
+                      size_t stop, int coefs, span_t &s)
+{
+    s.start = p;
+    s.overflow = 0;
+    s.blocks = 0;
+    s.rows.clear();
+    s.widths.assign(1, 0);
+    while (1) {
+        if (p >= len) {
+            s.status = -1;
+            return;
+        }
+        unsigned char b = data[p];
+        if (b == 0xff) {
+            if (p + 1 >= len || p + 2 + data[p + 1] > len) {
+                s.status = -1;
+                return;
+            }
+            p += data[p + 1] + 2;
+        } else if (b == 0xaf) {
+            s.exit = p;
+            s.status = 1;
+            return;
+        } else if (b == 0xae) {
+            p++;
+            s.rows.push_back(p);
+            s.widths.push_back(0);
+        } else if ((b & 0xfc) == 0xa0) {
+            if (p >= stop) {
+                s.exit = p;
+                s.status = 0;
+                return;
+            }
+            int pos;
+            if (!(p = walk_block(data, len, p, pos))) {
+                s.status = -1;
+                return;
+            }
+            s.overflow |= pos > coefs;
+            s.widths.back()++;
+            s.blocks++;
+        } else {
+            s.status = -1;
+            return;
+        }
+    }
+}
+
+// Adds what s found to the index so far, widths holding the blocks in
+// each row.
+static void add_span(const span_t &s, stream_index_t &idx,
+                     std::vector<int> &widths, int &last_row)
+{
+    for (size_t k = 0; k < s.widths.size(); k++) {
+        if (k) {
+            idx.row_offset.push_back(s.rows[k - 1]);
+            widths.push_back(0);
+        }
+        widths.back() += s.widths[k];
+        if (widths.back())
+            last_row = widths.size() - 1;
+    }
+    idx.blocks += s.blocks;
+    if (s.overflow)
+        idx.trusted = 0;
+}
+
+// First plausible block header at or after from, or len if there is none.
+static size_t find_resync(const unsigned char *data, size_t len, size_t from)
+{
+    for (size_t p = from > 0 ? from : 1; p + 3 <= len; p++) {
+        if ((data[p] & 0xfc) != 0xa0 || (data[p - 1] != 0xac && data[p - 1] != 0xae))
+            continue;
+        size_t q = p;
+        int pos, ok = 1;
+        for (int i = 0; i < RESYNC_BLOCKS && ok; i++) {
+            while (q < len && data[q] == 0xae)
+                q++;
+            if (q >= len || data[q] == 0xaf)
+                break;
+            ok = (data[q] & 0xfc) == 0xa0 && (q = walk_block(data, len, q, pos));
+        }
+        if (ok)
+            return p;
+    }
+    return len;
+}
+
+int vpeg_index_speculative(const unsigned char *data, size_t len,
+                           stream_index_t &idx, int threads, size_t min_chunk,
+                           int *rescanned)
+{
+    int chunks = threads;
+    if (min_chunk && len / min_chunk < (size_t) chunks)
+        chunks = len / min_chunk;
+    if (rescanned)
+        *rescanned = 0;
+    if (chunks <= 1)
+        return vpeg_index(data, len, idx);
+
+    idx.block_size = parse_block_size(data, len);
+    if (idx.block_size < 0)
+        return -1;
+    int coefs = idx.block_size * idx.block_size;
+
+    /* Guess and scan every range at once. */
+    std::vector<span_t> spans(chunks);
+    std::vector<size_t> bound(chunks + 1);
+    for (int i = 0; i <= chunks; i++)
+        bound[i] = len / chunks * i;
+    bound[chunks] = len;
+    std::vector<std::thread> pool;
+    for (int i = 0; i < chunks; i++)
+        pool.push_back(std::thread([&, i]() {
+            size_t start = i ? find_resync(data, len, bound[i])
+                             : stream_start(data, len);
+            if (start >= len)
+                spans[i].status = -1;
+            else
+                scan_span(data, len, start, bound[i + 1], coefs, spans[i]);
+        }));
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+
+    /* Stitch. The true scan stands at at; it takes a guess once it gets
+       there, and rescans the range if it steps over it. */
+    std::vector<int> widths(1, 0);
+    idx.row_offset.assign(1, stream_start(data, len));
+    idx.blocks = 0;
+    idx.trusted = 1;
+    idx.embedded = 0;
+    int last_row = -1;
+    size_t at = stream_start(data, len);
+    for (int i = 0; i < chunks; i++) {
+        span_t &s = spans[i];
+        if (i > 0 && s.status >= 0 && at < s.start) {
+            /* Usually a skip record in front of the first block past the
+               range, which a guess never starts behind. */
+            span_t bridge;
+            scan_span(data, len, at, s.start, coefs, bridge);
+            if (bridge.status < 0)
+                return -1;
+            add_span(bridge, idx, widths, last_row);
+            at = bridge.exit;
+            if (bridge.status == 1)
+                break;
+        }
+        if (i > 0 && (s.status < 0 || s.start != at)) {
+            scan_span(data, len, at, bound[i + 1], coefs, s);
+            if (rescanned)
+                (*rescanned)++;
+        }
+        if (s.status < 0)
+            return -1;
+        add_span(s, idx, widths, last_row);
+        at = s.exit;
+        if (s.status == 1)
+            break;
+    }
+    if (at >= len || data[at] != 0xaf)
+        return -1;
+    idx.end = at;
+
+    /* As in vpeg_index(): trailing empty rows do not count. */
+    idx.cols = 0;
+    for (size_t row = 0; row < widths.size(); row++)
+        if (widths[row] > idx.cols)
+            idx.cols = widths[row];
+    idx.rows = last_row + 1;
+    idx.row_offset.resize(idx.rows);
+    for (int row = 0; row < idx.rows; row++)
+        if (widths[row] != idx.cols)
+            idx.trusted = 0;
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Synthetic VPEG streams for benchmarking. The content is random but every
+ * stream is well formed, and the knobs in synth_params_t control the shape
+ * of the token stream the decoder sees.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vpeg.h"
+
+// xorshift64*, so that a seed gives the same stream everywhere.
+static unsigned long long rng_state;
+
+static unsigned long long rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1).
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Geometric with the given mean, 0 if the mean is 0.
+static int rng_geometric(double mean)
+{
+    if (mean <= 0)
+        return 0;
+    return (int) floor(log(1 - rng_unit()) / log(mean / (mean + 1)));
+}
+
+void synth_defaults(synth_params_t &p)
+{
+    p.width = 1024;
+    p.height = 1024;
+    p.density = 12;
+    p.quant_mix[0] = 1;
+    p.quant_mix[1] = 1;
+    p.quant_mix[2] = 1;
+    p.quant_mix[3] = 1;
+    p.run_length = 1.5;
+    p.skip_rate = 0.001;
+    p.dup_ratio = 0.05;
+    p.seed = 1;
+}
+
+static int pick_quant(const synth_params_t &p)
+{
+    double total = 0;
+    for (int i = 0; i < 4; i++)
+        total += p.quant_mix[i];
+    double u = rng_unit() * total;
+    for (int i = 0; i < 3; i++) {
+        if (u < p.quant_mix[i])
+            return i;
+        u -= p.quant_mix[i];
+    }
+    return 3;
+}
+
+static void synth_block(const synth_params_t &p, short *zz)
+{
+    memset(zz, 0, 64 * sizeof(short));
+    zz[0] = rng_next() % 2048;
+
+    /* Stochastic rounding keeps the mean coefficient count at density. */
+    int count = (int) p.density;
+    if (rng_unit() < p.density - count)
+        count++;
+
+    int pos = 0;
+    for (int i = 0; i < count; i++) {
+        pos += 1 + rng_geometric(p.run_length);
+        if (pos > 63)
+            break;
+        /* Amplitudes fall off towards the high frequencies. */
+        int value = 1 + rng_geometric(24.0 / (1 + pos / 8.0));
+        if (value > 127)
+            value = 127;
+        zz[pos] = rng_next() & 1 ? -value : value;
+    }
+}
+
+void synth_stream(const synth_params_t &p, std::vector<unsigned char> &out)
+{
+    int rows = p.height / 8, cols = p.width / 8;
+    std::vector<unsigned char> prev;
+
+    rng_state = p.seed * 0x9e3779b97f4a7c15ULL + 1;
+    out.clear();
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            if (rng_unit() < p.skip_rate) {
+                unsigned char payload[255];
+                int len = 1 + rng_next() % 64;
+                for (int i = 0; i < len; i++)
+                    payload[i] = rng_next();
+                emit_skip(out, payload, len);
+            }
+            if (!prev.empty() && rng_unit() < p.dup_ratio) {
+                out.insert(out.end(), prev.begin(), prev.end());
+                continue;
+            }
+            short zz[64];
+            synth_block(p, zz);
+            size_t start = out.size();
+            emit_block(out, zz, pick_quant(p));
+            prev.assign(out.begin() + start, out.end());
+        }
+        emit_row_end(out);
+    }
+    emit_eof(out);
+}
+
+// Generator options shared by vpeg-gen and vpeg-bench. Returns 1 if opt was
+// one of them, 0 if not, and -1 if its argument does not parse.
+int synth_option(synth_params_t &p, int opt, const char *arg)
+{
+    switch (opt) {
+    case 'w': p.width = atoi(arg); return 1;
+    case 'h': p.height = atoi(arg); return 1;
+    case 'd': p.density = atof(arg); return 1;
+    case 'r': p.run_length = atof(arg); return 1;
+    case 'k': p.skip_rate = atof(arg); return 1;
+    case 'u': p.dup_ratio = atof(arg); return 1;
+    case 's': p.seed = strtoul(arg, NULL, 0); return 1;
+    case 'q':
+        if (sscanf(arg, "%lf,%lf,%lf,%lf", &p.quant_mix[0], &p.quant_mix[1],
+                   &p.quant_mix[2], &p.quant_mix[3]) != 4)
+            return -1;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Block-major frames. Each block of the picture is stored as its own
+ * contiguous tile of n * n bytes, tiles in stream order, so an 8x8 block
+ * is exactly one 64-byte cache line. The decoder then writes whole lines:
+ * a block no longer touches eight lines shared with its neighbours, and
+ * workers on adjacent rows never write to the same line. Pixels are put
+ * back in raster order only on the way out, a strip at a time by
+ * write_pgm_tiled() or for any region by tiled_export().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#include "vpeg.h"
+
+#define CACHE_LINE 64
+
+int tiled_alloc(tiled_frame_t &t, int width, int height, int block_size)
+{
+    t.width = width;
+    t.height = height;
+    t.block_size = block_size;
+    t.cols = width / block_size;
+    t.rows = height / block_size;
+    size_t bytes = (size_t) t.cols * t.rows * block_size * block_size;
+    bytes = (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    t.tiles = (unsigned char *) aligned_alloc(CACHE_LINE, bytes ? bytes : CACHE_LINE);
+    if (!t.tiles)
+        return -1;
+    memset(t.tiles, 0, bytes);
+    return 0;
+}
+
+void tiled_free(tiled_frame_t &t)
+{
+    free(t.tiles);
+    t.tiles = NULL;
+}
+
+// The tile of block (row, col), as a frame of its own for the block
+// decoders, which then store with stride n.
+static frame_t tile_frame(const tiled_frame_t &t, int row, int col)
+{
+    int n = t.block_size;
+    frame_t f;
+    f.width = f.height = f.stride = n;
+    f.pixels = t.tiles + ((size_t) row * t.cols + col) * n * n;
+    return f;
+}
+
+// decode_indexed_row() into tiles. Blocks past the width of the frame are
+// parsed and dropped, as reconstruct_block() does for plain frames.
+static int decode_tiled_row(unsigned char *data, const stream_index_t &idx,
+                            tiled_frame_t &t, int row, deblock_t *d)
+{
+    unsigned char *bitstream = data + idx.row_offset[row];
+    unsigned char *quant = d ? deblock_quant(*d, row) : NULL;
+    int n = idx.block_size, quantval;
+    int trusted = idx.embedded ? check_embedded_row(data, idx, row) : idx.trusted;
+    short zz[16 * 16];
+    for (int col = 0; trusted >= 0; col++) {
+        CHECKSKIP;
+        if (*bitstream == 0xae || *bitstream == 0xaf)
+            break;
+        if (row >= t.rows || col >= t.cols) {
+            parse_block(zz, n, bitstream);
+            continue;
+        }
+        frame_t tile = tile_frame(t, row, col);
+        if (n == 8 && trusted) {
+            quantval = decode_block(bitstream, tile, 0, 0);
+        } else if (n == 8) {
+            quant_block_t zqb;
+            PROF_START();
+            quantval = parse_block(&zqb[0][0], 8, bitstream);
+            reconstruct_block(zqb, quantval, tile, 0, 0);
+            PROF_BLOCK(prof_coefficients(&zqb[0][0], 64), prof_t);
+        } else {
+            PROF_START();
+            quantval = parse_block(zz, n, bitstream);
+            reconstruct_block_n(zz, n, quantval, tile, 0, 0);
+            PROF_BLOCK(prof_coefficients(zz, n * n), prof_t);
+        }
+        if (quant)
+            quant[col] = quantval + 1;
+    }
+    if (d)
+        deblock_row(*d, row);
+    return trusted < 0 ? -1 : 0;
+}
+
+int vpeg_decode_tiled(unsigned char *data, const stream_index_t &idx,
+                      tiled_frame_t &t, int threads)
+{
+    PROF_START();
+    std::atomic<int> failed(0);
+    deblock_t deblock, *d = NULL;
+    if (vpeg_deblock) {
+        deblock_init_tiled(deblock, t);
+        d = &deblock;
+    }
+    if (threads > idx.rows)
+        threads = idx.rows;
+    if (threads <= 1) {
+        for (int row = 0; row < idx.rows; row++)
+            failed += decode_tiled_row(data, idx, t, row, d) < 0;
+    } else {
+        /* Same pool as vpeg_decode_indexed(). */
+        std::atomic<int> next_row(0);
+        std::vector<std::thread> pool;
+        for (int i = 0; i < threads; i++)
+            pool.push_back(std::thread([&]() {
+                int row;
+                while ((row = next_row++) < idx.rows)
+                    failed += decode_tiled_row(data, idx, t, row, d) < 0;
+            }));
+        for (size_t i = 0; i < pool.size(); i++)
+            pool[i].join();
+    }
+    PROF_IMAGE(prof_t);
+    return failed;
+}
+
+// Copies the region of t with its top left corner at (x, y) and the size
+// of f into f. Parts of the region outside t are left alone.
+void tiled_export(const tiled_frame_t &t, int x, int y, frame_t &f)
+{
+    int n = t.block_size;
+    int x1 = x + f.width < t.cols * n ? x + f.width : t.cols * n;
+    int y1 = y + f.height < t.rows * n ? y + f.height : t.rows * n;
+    for (int py = y > 0 ? y : 0; py < y1; py++) {
+        const unsigned char *tile_row = t.tiles + (size_t) (py / n) * t.cols * n * n +
+                                        (py % n) * n;
+        unsigned char *dst = f.pixels + (size_t) (py - y) * f.stride - x;
+        int px = x > 0 ? x : 0;
+        /* Up to the first tile boundary, then a tile row at a time. */
+        for (; px < x1 && px % n; px++)
+            dst[px] = tile_row[(size_t) (px / n) * n * n + px % n];
+        for (; px + n <= x1; px += n)
+            memcpy(dst + px, tile_row + (size_t) (px / n) * n * n, n);
+        for (; px < x1; px++)
+            dst[px] = tile_row[(size_t) (px / n) * n * n + px % n];
+    }
+}
+
+// write_pgm() for tiled frames: each row of tiles is turned into raster
+// lines in a strip buffer just before it is written.
+int write_pgm_tiled(const char *path, const tiled_frame_t &t)
+{
+    PROF_START();
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return -1;
+    fprintf(fp, "P5 %d %d 255\n", t.width, t.height);
+    int n = t.block_size;
+    frame_t strip;
+    frame_alloc(strip, t.width, n);
+    for (int y = 0; y < t.height; y += n) {
+        int lines = t.height - y < n ? t.height - y : n;
+        memset(strip.pixels, 0, (size_t) strip.stride * n);
+        tiled_export(t, 0, y, strip);
+        fwrite(strip.pixels, (size_t) t.width * lines, 1, fp);
+    }
+    frame_free(strip);
+    int ret = fclose(fp) ? -1 : 0;
+    PROF_STAGE(PROF_WRITE);
+    return ret;
+}
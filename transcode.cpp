@@ -0,0 +1,264 @@
+/*
+ * Transcoding in the coefficient domain: the picture is parsed into its
+ * quantized coefficients, rearranged, and written back out without any
+ * inverse or forward DCT.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <functional>
+#include <queue>
+
+#include "vpeg.h"
+
+int parse_coefficients(unsigned char *data, size_t len, coef_picture_t &p)
+{
+    stream_index_t idx;
+    std::vector<skip_record_t> skips;
+    if (vpeg_index(data, len, idx, &skips) < 0 || idx.block_size != 8)
+        return -1;
+
+    p.rows = idx.rows;
+    p.cols = idx.cols;
+    p.blocks.assign((size_t) p.rows * p.cols, coef_block_t());
+    p.skips.clear();
+    for (size_t i = 0; i < skips.size(); i++) {
+        /* An embedded row index would point at the old layout, and the
+           output is a single picture, not a sequence. */
+        if (is_row_index_record(data + skips[i].offset + 2, skips[i].len) ||
+            is_sequence_record(data + skips[i].offset + 2, skips[i].len))
+            continue;
+        p.skips.push_back(std::vector<unsigned char>(
+            data + skips[i].offset + 2,
+            data + skips[i].offset + 2 + skips[i].len));
+    }
+
+    for (int row = 0; row < p.rows; row++) {
+        signed char *bitstream = (signed char *) data + idx.row_offset[row];
+        for (int col = 0; ; col++) {
+            CHECKSKIP;
+            if ((unsigned char) *bitstream == 0xae ||
+                (unsigned char) *bitstream == 0xaf) {
+                /* A short row has nowhere to go once blocks move. */
+                if (col != p.cols)
+                    return -1;
+                break;
+            }
+            /* parse_block() rather than irle(): the stream need not be
+               trusted, and it keeps the DC bytes as written. */
+            coef_block_t &b = p.blocks[(size_t) row * p.cols + col];
+            quant_block_t zqb;
+            unsigned char *tokens = (unsigned char *) bitstream;
+            b.quantval = parse_block(&zqb[0][0], 8, tokens);
+            bitstream = (signed char *) tokens;
+            izigzag(zqb, b.c);
+        }
+    }
+    return 0;
+}
+
+// Skip records cannot keep their place once blocks move around, so they are
+// all written first.
+void emit_coefficients(const coef_picture_t &p, std::vector<unsigned char> &out)
+{
+    out.clear();
+    for (size_t i = 0; i < p.skips.size(); i++)
+        emit_skip(out, p.skips[i].data(), p.skips[i].size());
+    for (int row = 0; row < p.rows; row++) {
+        for (int col = 0; col < p.cols; col++) {
+            const coef_block_t &b = p.blocks[(size_t) row * p.cols + col];
+            quant_block_t zz;
+            zigzag((quant_block_t &) b.c, zz);
+            emit_block(out, &zz[0][0], b.quantval);
+        }
+        emit_row_end(out);
+    }
+    emit_eof(out);
+}
+
+// idct88() runs rows, transposes and runs rows again, so coefficient
+// c[i][n] scales the horizontal basis function i and the vertical one n.
+// Mirroring a basis function of odd frequency flips its sign; transposing
+// the pixels transposes the coefficients. The quantization matrices are
+// symmetric, so the quantization level stays valid either way.
+static void transform_block(const coef_block_t &in, int xform, coef_block_t &out)
+{
+    int swap = xform == XFORM_TRANSPOSE || xform == XFORM_ROT90 ||
+               xform == XFORM_ROT270;
+    int flip_x = xform == XFORM_FLIP_H || xform == XFORM_ROT90 ||
+                 xform == XFORM_ROT180;
+    int flip_y = xform == XFORM_FLIP_V || xform == XFORM_ROT180 ||
+                 xform == XFORM_ROT270;
+
+    out.quantval = in.quantval;
+    for (int i = 0; i < 8; i++)
+        for (int n = 0; n < 8; n++) {
+            /* Transpose first, then mirror the result. */
+            short v = swap ? in.c[n][i] : in.c[i][n];
+            if (((flip_x && (i & 1)) + (flip_y && (n & 1))) == 1)
+                v = -v;
+            out.c[i][n] = v;
+        }
+    out.c[0][0] = in.c[0][0];
+}
+
+void transform_coefficients(const coef_picture_t &in, int xform,
+                            coef_picture_t &out)
+{
+    int swap = xform == XFORM_TRANSPOSE || xform == XFORM_ROT90 ||
+               xform == XFORM_ROT270;
+    out.rows = swap ? in.cols : in.rows;
+    out.cols = swap ? in.rows : in.cols;
+    out.skips = in.skips;
+    out.blocks.resize(in.blocks.size());
+
+    for (int row = 0; row < in.rows; row++)
+        for (int col = 0; col < in.cols; col++) {
+            int r = row, c = col;
+            switch (xform) {
+            case XFORM_FLIP_H:    c = in.cols - 1 - col; break;
+            case XFORM_FLIP_V:    r = in.rows - 1 - row; break;
+            case XFORM_TRANSPOSE: r = col; c = row; break;
+            case XFORM_ROT90:     r = col; c = in.rows - 1 - row; break;
+            case XFORM_ROT180:    r = in.rows - 1 - row; c = in.cols - 1 - col; break;
+            case XFORM_ROT270:    r = in.cols - 1 - col; c = row; break;
+            }
+            transform_block(in.blocks[(size_t) row * in.cols + col], xform,
+                            out.blocks[(size_t) r * out.cols + c]);
+        }
+}
+
+int crop_coefficients(coef_picture_t &p, int col0, int row0, int cols, int rows)
+{
+    if (col0 < 0 || row0 < 0 || cols <= 0 || rows <= 0 ||
+        col0 + cols > p.cols || row0 + rows > p.rows)
+        return -1;
+    std::vector<coef_block_t> kept;
+    kept.reserve((size_t) cols * rows);
+    for (int row = row0; row < row0 + rows; row++)
+        kept.insert(kept.end(), p.blocks.begin() + (size_t) row * p.cols + col0,
+                    p.blocks.begin() + (size_t) row * p.cols + col0 + cols);
+    p.blocks.swap(kept);
+    p.cols = cols;
+    p.rows = rows;
+    return 0;
+}
+
+// Moves block b to a coarser quantization level. Every zone of
+// quant_values grows with the level, so magnitudes only ever shrink.
+void requantize_block(const coef_block_t &in, int quantval, coef_block_t &out)
+{
+    out.quantval = quantval;
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++) {
+            int zone = (y>4) + (x>4);
+            double v = (double) in.c[y][x] * quant_values[in.quantval][zone] /
+                       quant_values[quantval][zone];
+            out.c[y][x] = (short) lround(v);
+        }
+}
+
+// Squared error of the dequantized coefficients, the same measure in pixel
+// terms since the DCT is orthogonal up to scale.
+static double requant_error(const coef_block_t &orig, const coef_block_t &b)
+{
+    double err = 0;
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++) {
+            if (!y && !x)
+                continue;
+            int zone = (y>4) + (x>4);
+            double d = orig.c[y][x] * quant_values[orig.quantval][zone] -
+                       b.c[y][x] * quant_values[b.quantval][zone];
+            err += d * d;
+        }
+    return err;
+}
+
+static size_t block_bytes(const coef_block_t &b, std::vector<unsigned char> &scratch)
+{
+    quant_block_t zz;
+    zigzag((quant_block_t &) b.c, zz);
+    scratch.clear();
+    emit_block(scratch, &zz[0][0], b.quantval);
+    return scratch.size();
+}
+
+// Size and error of a block at each level it can move to.
+struct level_cost_t {
+    size_t bytes[4];
+    double err[4];
+    int level;
+};
+
+// The coarser level with the least added error per byte saved, or -1.
+static int next_level(const level_cost_t &c, double &best)
+{
+    int target = -1;
+    for (int q = c.level + 1; q < 4; q++) {
+        if (c.bytes[q] >= c.bytes[c.level])
+            continue;
+        double ratio = (c.err[q] - c.err[c.level]) /
+                       (c.bytes[c.level] - c.bytes[q]);
+        if (target < 0 || ratio < best) {
+            best = ratio;
+            target = q;
+        }
+    }
+    return target;
+}
+
+// Greedy rate-distortion search: repeatedly take the level change that
+// costs the least added error per byte saved, until the stream fits.
+// Returns the size of the stream as it will be emitted.
+size_t requantize_to_budget(coef_picture_t &p, size_t budget)
+{
+    std::vector<level_cost_t> cost(p.blocks.size());
+    std::vector<unsigned char> scratch;
+    size_t total = p.rows + 1;
+    for (size_t i = 0; i < p.skips.size(); i++)
+        total += p.skips[i].size() + 2;
+
+    for (size_t i = 0; i < p.blocks.size(); i++) {
+        const coef_block_t &b = p.blocks[i];
+        level_cost_t &c = cost[i];
+        c.level = b.quantval;
+        for (int q = b.quantval; q < 4; q++) {
+            coef_block_t r;
+            requantize_block(b, q, r);
+            c.bytes[q] = block_bytes(r, scratch);
+            c.err[q] = requant_error(b, r);
+        }
+        total += c.bytes[b.quantval];
+    }
+
+    /* Best next move per block, as (error per byte saved, block). */
+    typedef std::pair<double, size_t> move_t;
+    std::priority_queue<move_t, std::vector<move_t>, std::greater<move_t> > moves;
+    std::vector<int> target(p.blocks.size(), -1);
+    for (size_t i = 0; i < p.blocks.size(); i++) {
+        double ratio;
+        if ((target[i] = next_level(cost[i], ratio)) >= 0)
+            moves.push(move_t(ratio, i));
+    }
+
+    while (total > budget && !moves.empty()) {
+        size_t i = moves.top().second;
+        moves.pop();
+        level_cost_t &c = cost[i];
+        total -= c.bytes[c.level] - c.bytes[target[i]];
+        c.level = target[i];
+
+        double ratio;
+        if ((target[i] = next_level(c, ratio)) >= 0)
+            moves.push(move_t(ratio, i));
+    }
+
+    for (size_t i = 0; i < p.blocks.size(); i++)
+        if (cost[i].level != p.blocks[i].quantval) {
+            coef_block_t r;
+            requantize_block(p.blocks[i], cost[i].level, r);
+            p.blocks[i] = r;
+        }
+    return total;
+}
@@ -0,0 +1,131 @@
+/*
+ * io_uring set up by hand: one mapping for each ring plus the submission
+ * entries, with acquire/release ordering on the shared head and tail.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+int uring_init(uring_t &r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(&r, 0, sizeof(r));
+    r.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r.fd < 0)
+        return -1;
+
+    r.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r.sq_ring = mmap(NULL, r.sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    r.cq_ring = mmap(NULL, r.cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+    r.sqes = (struct io_uring_sqe *) mmap(NULL, r.sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r.fd,
+                                          IORING_OFF_SQES);
+    if (r.sq_ring == MAP_FAILED || r.cq_ring == MAP_FAILED ||
+        r.sqes == MAP_FAILED) {
+        close(r.fd);
+        return -1;
+    }
+
+    char *sq = (char *) r.sq_ring, *cq = (char *) r.cq_ring;
+    r.sq_head = (unsigned *) (sq + p.sq_off.head);
+    r.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r.sq_array = (unsigned *) (sq + p.sq_off.array);
+    r.cq_head = (unsigned *) (cq + p.cq_off.head);
+    r.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r.sq_entries = p.sq_entries;
+    return 0;
+}
+
+void uring_exit(uring_t &r)
+{
+    munmap(r.sqes, r.sqes_size);
+    munmap(r.cq_ring, r.cq_ring_size);
+    munmap(r.sq_ring, r.sq_ring_size);
+    close(r.fd);
+}
+
+int uring_register_buffers(uring_t &r, const struct iovec *iov, unsigned count)
+{
+    return syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS,
+                   iov, count);
+}
+
+int uring_supports(uring_t &r, int op)
+{
+    /* Kernels from before probing also lack the plain read and write. */
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = (struct io_uring_probe *) calloc(1, size);
+    int ok = p && syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE,
+                          p, 256) == 0 &&
+             op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t &r)
+{
+    unsigned head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r.sq_tail + r.queued;
+    if (tail - head >= r.sq_entries)
+        return NULL;
+    unsigned index = tail & *r.sq_mask;
+    r.sq_array[index] = index;
+    r.queued++;
+    memset(&r.sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &r.sqes[index];
+}
+
+int uring_submit(uring_t &r, unsigned wait)
+{
+    unsigned count = r.queued;
+    __atomic_store_n(r.sq_tail, *r.sq_tail + count, __ATOMIC_RELEASE);
+    r.queued = 0;
+    return syscall(__NR_io_uring_enter, r.fd, count, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_cqe *uring_cqe(uring_t &r)
+{
+    unsigned head = *r.cq_head;
+    if (head == __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r.cqes[head & *r.cq_mask];
+}
+
+void uring_seen(uring_t &r)
+{
+    __atomic_store_n(r.cq_head, *r.cq_head + 1, __ATOMIC_RELEASE);
+    r.completed++;
+}
+
+// Every request completes exactly once, so the kernel is done when the
+// completions seen catch up with the entries it took from the queue.
+int uring_drain(uring_t &r)
+{
+    while (__atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) != r.completed) {
+        if (uring_cqe(r)) {
+            uring_seen(r);
+            continue;
+        }
+        if (syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    NULL, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Minimal io_uring wrapper on the raw system calls, so batch decoding does
+ * not need liburing.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring_t {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, queued;
+    unsigned completed;           // completions seen, against *sq_head
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int uring_init(uring_t &r, unsigned entries);
+void uring_exit(uring_t &r);
+int uring_register_buffers(uring_t &r, const struct iovec *iov, unsigned count);
+// Whether the kernel knows opcode op.
+int uring_supports(uring_t &r, int op);
+// Next free submission entry, cleared, or NULL if the ring is full.
+struct io_uring_sqe *uring_sqe(uring_t &r);
+// Submits everything queued and waits for at least wait completions.
+int uring_submit(uring_t &r, unsigned wait);
+// Oldest unseen completion or NULL; uring_seen() hands it back.
+struct io_uring_cqe *uring_cqe(uring_t &r);
+void uring_seen(uring_t &r);
+// Waits until every request the kernel took has completed, so the buffers
+// it reads or writes can be freed. Returns -1 if it cannot wait.
+int uring_drain(uring_t &r);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * vpeg-bench: decode synthetic streams over a sweep of picture sizes and
+ * thread counts, and report throughput and scaling efficiency relative to
+ * a single thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-bench [options]\n"
+            "  -S s1,s2,...  square picture sizes to sweep (256,512,1024,2048)\n"
+            "  -T t1,t2,...  thread counts to sweep (1,2,4,... up to the cores)\n"
+            "  -n reps       decodes per point, the fastest one counts (3)\n"
+            "  -t name       inverse transform: double, float or avx512 (double)\n"
+            "  -l            decode into a tiled frame instead of a raster one\n"
+            "  -D            deblock while decoding\n"
+            "  -d, -q, -r, -k, -u, -s as for vpeg-gen\n");
+    exit(1);
+}
+
+static std::vector<int> parse_list(const char *arg)
+{
+    std::vector<int> list;
+    for (const char *s = arg; *s; ) {
+        list.push_back(atoi(s));
+        s += strcspn(s, ",");
+        if (*s == ',')
+            s++;
+    }
+    return list;
+}
+
+int main(int argc, char **argv)
+{
+    synth_params_t p;
+    std::vector<int> sizes, threads;
+    int reps = 3, transform = 0, tiled = 0, opt;
+
+    synth_defaults(p);
+    while ((opt = getopt(argc, argv, "S:T:n:t:lDd:q:r:k:u:s:")) != -1) {
+        switch (opt) {
+        case 'S': sizes = parse_list(optarg); break;
+        case 'T': threads = parse_list(optarg); break;
+        case 'n': reps = atoi(optarg); break;
+        case 'l': tiled = 1; break;
+        case 'D': vpeg_deblock = 1; break;
+        case 't':
+            while (strcmp(optarg, transform_name(transform)))
+                if (++transform > TRANSFORM_AVX512)
+                    usage();
+            break;
+        default:
+            if (synth_option(p, opt, optarg) <= 0)
+                usage();
+        }
+    }
+    if (transform && transform_select(transform) != transform)
+        fprintf(stderr, "Using the %s transform.\n",
+                transform_name(vpeg_transform));
+    if (sizes.empty())
+        sizes = parse_list("256,512,1024,2048");
+    if (threads.empty()) {
+        int cores = std::thread::hardware_concurrency();
+        for (int t = 1; t < cores; t *= 2)
+            threads.push_back(t);
+        threads.push_back(cores > 0 ? cores : 1);
+    }
+
+    printf("%6s %7s %10s %9s %9s %9s %8s %6s\n", "size", "threads",
+           "stream", "ms", "Mpix/s", "MB/s", "speedup", "eff");
+    for (size_t i = 0; i < sizes.size(); i++) {
+        p.width = p.height = sizes[i] / 8 * 8;
+        std::vector<unsigned char> stream;
+        synth_stream(p, stream);
+
+        stream_index_t idx;
+        if (vpeg_index(stream.data(), stream.size(), idx) < 0) {
+            fprintf(stderr, "Generated a malformed stream.\n");
+            return 1;
+        }
+        frame_t f;
+        tiled_frame_t t;
+        frame_alloc(f, idx.cols * idx.block_size, idx.rows * idx.block_size);
+        tiled_alloc(t, f.width, f.height, idx.block_size);
+
+        double base = 0;
+        for (size_t j = 0; j < threads.size(); j++) {
+            double best = 1e30;
+            for (int r = 0; r < reps; r++) {
+                double t0 = now_seconds();
+                if (tiled)
+                    vpeg_decode_tiled(stream.data(), idx, t, threads[j]);
+                else
+                    vpeg_decode_indexed(stream.data(), idx, f, threads[j]);
+                double elapsed = now_seconds() - t0;
+                if (elapsed < best)
+                    best = elapsed;
+            }
+            if (j == 0)
+                base = best * threads[0];
+            double speedup = base / best;
+            printf("%6d %7d %10zu %9.2f %9.2f %9.2f %8.2f %5.0f%%\n",
+                   p.width, threads[j], stream.size(), best * 1e3,
+                   (double) f.width * f.height / best * 1e-6,
+                   stream.size() / best * 1e-6, speedup,
+                   100 * speedup / threads[j]);
+        }
+        frame_free(f);
+        tiled_free(t);
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * vpeg-enc: encode a PGM picture as a VPEG stream.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-enc [-q level] [-b size] [-j threads] [-c] [-x] input.pgm... output.vpeg\n"
+            "  Several inputs make a sequence, each frame only carrying the\n"
+            "  blocks that changed since the one before.\n"
+            "  -q level    quantization level 0-3 (1)\n"
+            "  -b size     block size 4, 8 or 16, single pictures only (8)\n"
+            "  -j threads  encode rows of blocks in parallel (1)\n"
+            "  -c          parse the stream back and check every coefficient,\n"
+            "              then decode it and check the pixels\n"
+            "  -x          embed a row index, single pictures only\n");
+    exit(1);
+}
+
+// Largest change that rounding every AC coefficient of an n x n block to
+// its step can make at pixel (x, y): half a step times the basis function,
+// summed. The zones of quant_values are symmetric, so it does not matter
+// which frequency is the horizontal one.
+static double rounding_bound(int n, int quantval, int x, int y)
+{
+    double bound = 0;
+    for (int a = 0; a < n; a++)
+        for (int b = 0; b < n; b++) {
+            if (!a && !b)
+                continue;
+            int zone = (a * 8 / n > 4) + (b * 8 / n > 4);
+            double step = quant_values[quantval][zone] * (n * n / 8);
+            double ba = (a ? cos(M_PI / n * a * (x + 0.5)) : 0.5) * 2.0 / n;
+            double bb = (b ? cos(M_PI / n * b * (y + 0.5)) : 0.5) * 2.0 / n;
+            bound += step / 2 * fabs(ba * bb);
+        }
+    return bound;
+}
+
+// The decoder pins DC at mid-gray 256, so a decoded block is the picture
+// block less its mean, plus 256, clamped, and off by at most the rounding
+// of its AC coefficients and of the store. Blocks with a coefficient
+// clamped to +-127 by quant() are left out, their error has no bound.
+static int check_pixels(const frame_t &f, const frame_t &out, int n,
+                        int quantval, const std::vector<char> &clamped,
+                        long &checked)
+{
+    std::vector<double> bound(n * n);
+    for (int y = 0; y < n; y++)
+        for (int x = 0; x < n; x++)
+            bound[y * n + x] = rounding_bound(n, quantval, x, y) + 1;
+    int cols = (f.width + n - 1) / n, rows = (f.height + n - 1) / n;
+    checked = 0;
+    for (int row = 0; row < rows; row++)
+        for (int col = 0; col < cols; col++) {
+            if (clamped[row * cols + col])
+                continue;
+            /* The mean of the block as encoded, edges repeated. */
+            double mean = 0;
+            for (int y = 0; y < n; y++)
+                for (int x = 0; x < n; x++) {
+                    int py = row * n + y < f.height ? row * n + y : f.height - 1;
+                    int px = col * n + x < f.width ? col * n + x : f.width - 1;
+                    mean += f.pixels[(size_t) py * f.stride + px];
+                }
+            mean /= n * n;
+            for (int y = 0; y < n && row * n + y < f.height; y++)
+                for (int x = 0; x < n && col * n + x < f.width; x++) {
+                    int px = col * n + x, py = row * n + y;
+                    double want = f.pixels[(size_t) py * f.stride + px] - mean + 256;
+                    want = want < 0 ? 0 : (want > 255 ? 255 : want);
+                    int got = out.pixels[(size_t) py * out.stride + px];
+                    if (fabs(got - want) > bound[y * n + x]) {
+                        fprintf(stderr, "Check: pixel %d,%d is %d, expected %.0f "
+                                "within %.0f.\n", px, py, got, want, bound[y * n + x]);
+                        return -1;
+                    }
+                }
+            checked++;
+        }
+    return 0;
+}
+
+// Round trip through the decoder's own parser: every block must come back
+// from irle() and izigzag() exactly as the encoder quantized it. Then the
+// decoded picture must match the input within quantization error.
+static int check_stream(const frame_t &f, int quantval,
+                        std::vector<unsigned char> &stream)
+{
+    stream_index_t idx;
+    if (vpeg_index(stream.data(), stream.size(), idx) < 0) {
+        fprintf(stderr, "Check: malformed stream.\n");
+        return -1;
+    }
+    int n = idx.block_size;
+    if (idx.cols != (f.width + n - 1) / n || idx.rows != (f.height + n - 1) / n) {
+        fprintf(stderr, "Check: stream is %dx%d blocks.\n", idx.cols, idx.rows);
+        return -1;
+    }
+    std::vector<char> clamped((size_t) idx.rows * idx.cols);
+    for (int row = 0; row < idx.rows; row++) {
+        signed char *bitstream = (signed char *) stream.data() + idx.row_offset[row];
+        for (int col = 0; col < idx.cols; col++) {
+            if (n != 8) {
+                short zz[16 * 16], expect[16 * 16];
+                unsigned char *p = (unsigned char *) bitstream;
+                int q = parse_block(zz, n, p);
+                bitstream = (signed char *) p;
+                encode_block_n(f, n, row, col, quantval, expect);
+                zz[0] = expect[0];
+                if (q != quantval || memcmp(zz, expect, n * n * sizeof(short))) {
+                    fprintf(stderr, "Check: block %d,%d differs.\n", row, col);
+                    return -1;
+                }
+                for (int i = 1; i < n * n; i++)
+                    clamped[row * idx.cols + col] |= abs(expect[i]) >= 127;
+                continue;
+            }
+            quant_block_t zqb, qb, expect;
+            int q = irle(zqb, bitstream);
+            izigzag(zqb, qb);
+            encode_coefficients(f, row, col, quantval, expect);
+            /* The decoder reads the DC value as signed bytes and replaces
+               it in dequant() anyway, so only the level and AC terms count. */
+            qb[0][0] = expect[0][0];
+            if (q != quantval || memcmp(qb, expect, sizeof(qb))) {
+                fprintf(stderr, "Check: block %d,%d differs.\n", row, col);
+                return -1;
+            }
+            for (int i = 1; i < 64; i++)
+                clamped[row * idx.cols + col] |= abs(expect[i / 8][i % 8]) >= 127;
+        }
+    }
+
+    frame_t out;
+    frame_alloc(out, idx.cols * n, idx.rows * n);
+    vpeg_decode_indexed(stream.data(), idx, out, 1);
+    long pixel_blocks;
+    int ret = check_pixels(f, out, n, quantval, clamped, pixel_blocks);
+    frame_free(out);
+    if (ret < 0)
+        return -1;
+    printf("Checked %ld blocks, the pixels of %ld.\n", idx.blocks, pixel_blocks);
+    return 0;
+}
+
+static int encode_sequence(char **inputs, int count, int quantval,
+                           const char *output)
+{
+    seq_encoder_t s;
+    std::vector<unsigned char> stream;
+    for (int i = 0; i < count; i++) {
+        frame_t f;
+        if (read_pgm(inputs[i], f) < 0) {
+            fprintf(stderr, "%s: not a readable 8-bit PGM file.\n", inputs[i]);
+            return 1;
+        }
+        if (i == 0)
+            seq_encoder_init(s, f.width, f.height, quantval);
+        size_t before = stream.size();
+        if (seq_encode_frame(s, f, stream) < 0) {
+            fprintf(stderr, "%s: size differs from the first frame.\n", inputs[i]);
+            return 1;
+        }
+        printf("Frame %d: %zu bytes.\n", i, stream.size() - before);
+        frame_free(f);
+    }
+    if (write_file(output, stream) < 0) {
+        perror(output);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int quantval = 1, block_size = 8, threads = 1, check = 0, index = 0, opt;
+    while ((opt = getopt(argc, argv, "q:b:j:cx")) != -1) {
+        switch (opt) {
+        case 'q':
+            quantval = atoi(optarg);
+            if (quantval < 0 || quantval > 3)
+                usage();
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            if (!valid_block_size(block_size))
+                usage();
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            check = 1;
+            break;
+        case 'x':
+            index = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2)
+        usage();
+    const char *output = argv[argc - 1];
+    if (argc - optind > 2 && (block_size != 8 || index))
+        usage();
+    if (argc - optind > 2)
+        return encode_sequence(argv + optind, argc - optind - 1, quantval,
+                               output);
+
+    frame_t f;
+    if (read_pgm(argv[optind], f) < 0) {
+        fprintf(stderr, "%s: not a readable 8-bit PGM file.\n", argv[optind]);
+        return 1;
+    }
+
+    std::vector<unsigned char> stream;
+    double t0 = now_seconds();
+    vpeg_encode(f, quantval, threads, stream, block_size);
+    double t = now_seconds() - t0;
+    printf("Encoded %dx%d into %zu bytes in %.2f ms.\n", f.width, f.height,
+           stream.size(), t * 1e3);
+
+    if (check && check_stream(f, quantval, stream) < 0)
+        return 1;
+    if (index) {
+        std::vector<unsigned char> indexed;
+        if (vpeg_embed_index(stream.data(), stream.size(), indexed) < 0) {
+            fprintf(stderr, "Picture too large to index.\n");
+            return 1;
+        }
+        stream.swap(indexed);
+    }
+
+    if (write_file(output, stream) < 0) {
+        perror(output);
+        return 1;
+    }
+    frame_free(f);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * vpeg-gen: write a synthetic VPEG stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-gen [options] output.vpeg\n"
+            "  -w width      picture width in pixels, multiple of 8 (1024)\n"
+            "  -h height     picture height in pixels, multiple of 8 (1024)\n"
+            "  -d density    mean nonzero AC coefficients per block (12)\n"
+            "  -q a,b,c,d    relative weights of quantization levels 0-3 (1,1,1,1)\n"
+            "  -r run        mean zero-run between coefficients (1.5)\n"
+            "  -k rate       probability of a 0xff skip record per block (0.001)\n"
+            "  -u ratio      probability of a duplicated block (0.05)\n"
+            "  -s seed       random seed (1)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    synth_params_t p;
+    int opt;
+
+    synth_defaults(p);
+    while ((opt = getopt(argc, argv, "w:h:d:q:r:k:u:s:")) != -1)
+        if (synth_option(p, opt, optarg) <= 0)
+            usage();
+    if (optind + 1 != argc)
+        usage();
+    if (p.width < 8 || p.width > 16384 || p.width % 8 ||
+        p.height < 8 || p.height > 16384 || p.height % 8) {
+        fprintf(stderr, "Geometry must be multiples of 8 up to 16384.\n");
+        return 1;
+    }
+
+    std::vector<unsigned char> stream;
+    synth_stream(p, stream);
+
+    FILE *f = fopen(argv[optind], "wb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fwrite(stream.data(), stream.size(), 1, f);
+    fclose(f);
+    printf("Wrote %dx%d, %zu bytes.\n", p.width, p.height, stream.size());
+    return 0;
+}
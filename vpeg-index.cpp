@@ -0,0 +1,58 @@
+/*
+ * vpeg-index: embed a row index in a VPEG stream, or take it out again.
+ * Older decoders skip the index records like any other skip record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-index [-r] input.vpeg output.vpeg\n"
+            "  -r  remove an embedded index instead\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int strip = 0, opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            strip = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2)
+        usage();
+
+    std::vector<unsigned char> input, output;
+    if (read_file(argv[optind], input) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (strip) {
+        vpeg_strip_index(input.data(), input.size(), output);
+    } else if (vpeg_embed_index(input.data(), input.size(), output) < 0) {
+        fprintf(stderr, "Malformed or non-rectangular stream, or too large to index.\n");
+        return 1;
+    }
+
+    stream_index_t idx;
+    if (!strip && vpeg_embedded_index(output.data(), output.size(), idx) == 0)
+        printf("Indexed %d rows in %zu bytes.\n", idx.rows,
+               output.size() - input.size());
+    else
+        printf("%zu bytes -> %zu bytes.\n", input.size(), output.size());
+    if (write_file(argv[optind + 1], output) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ * vpeg-stat: token statistics of a corpus of VPEG streams, gathered with
+ * the decoder's own parser and no transform, and the decoder settings they
+ * suggest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#include "vpeg.h"
+
+#define MAX_COEFS (16 * 16)
+#define RUN_BUCKETS 17          // zero runs 0 to 15, then 16 and longer
+
+struct corpus_stats_t {
+    unsigned long long files, failed, untrusted, bytes, blocks, pixels, rows;
+    unsigned long long duplicates, skip_records, skip_bytes;
+    unsigned long long coefs[MAX_COEFS + 1];    // nonzero AC terms per block
+    unsigned long long last[MAX_COEFS];         // last nonzero scan index
+    unsigned long long quant[4];
+    unsigned long long runs[RUN_BUCKETS];
+    unsigned long long block_size[17];
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-stat [-J] input.vpeg...\n"
+            "  -J  print JSON instead of text\n");
+    exit(1);
+}
+
+// Everything the decoder will see of one block, DC excepted since
+// dequant() replaces it, as a key for spotting repeated blocks.
+static std::string block_key(const short *zz, int count, int quantval)
+{
+    std::string key((const char *) (zz + 1), (count - 1) * sizeof(short));
+    key.push_back(quantval);
+    return key;
+}
+
+static void add_block(corpus_stats_t &s, const short *zz, int count,
+                      int quantval, std::unordered_set<std::string> &seen)
+{
+    int nonzero = 0, last = 0, run = 0;
+    for (int i = 1; i < count; i++) {
+        if (!zz[i]) {
+            run++;
+            continue;
+        }
+        nonzero++;
+        last = i;
+        s.runs[run < RUN_BUCKETS - 1 ? run : RUN_BUCKETS - 1]++;
+        run = 0;
+    }
+    s.coefs[nonzero]++;
+    s.last[last]++;
+    s.quant[quantval]++;
+    s.blocks++;
+    if (!seen.insert(block_key(zz, count, quantval)).second)
+        s.duplicates++;
+}
+
+static int stat_file(corpus_stats_t &s, const char *path)
+{
+    std::vector<unsigned char> data;
+    stream_index_t idx;
+    std::vector<skip_record_t> skips;
+    if (read_file(path, data) < 0 ||
+        vpeg_index(data.data(), data.size(), idx, &skips) < 0)
+        return -1;
+
+    int n = idx.block_size, count = n * n;
+    std::unordered_set<std::string> seen;
+    for (int row = 0; row < idx.rows; row++) {
+        unsigned char *bitstream = data.data() + idx.row_offset[row];
+        while (1) {
+            CHECKSKIP;
+            if (*bitstream == 0xae || *bitstream == 0xaf)
+                break;
+            short zz[MAX_COEFS];
+            int quantval;
+            if (n == 8 && idx.trusted) {
+                quant_block_t zqb;
+                signed char *tokens = (signed char *) bitstream;
+                quantval = irle(zqb, tokens);
+                bitstream = (unsigned char *) tokens;
+                memcpy(zz, zqb, sizeof(zqb));
+            } else {
+                quantval = parse_block(zz, n, bitstream);
+            }
+            add_block(s, zz, count, quantval, seen);
+        }
+    }
+    s.files++;
+    s.untrusted += !idx.trusted;
+    s.bytes += data.size();
+    s.pixels += (unsigned long long) idx.cols * idx.rows * count;
+    s.rows += idx.rows;
+    s.block_size[n]++;
+    s.skip_records += skips.size();
+    for (size_t i = 0; i < skips.size(); i++)
+        s.skip_bytes += skips[i].len + 2;
+    return 0;
+}
+
+static double mean(const unsigned long long *hist, int n)
+{
+    unsigned long long total = 0, sum = 0;
+    for (int i = 0; i < n; i++) {
+        total += hist[i];
+        sum += hist[i] * i;
+    }
+    return total ? (double) sum / total : 0;
+}
+
+// Smallest value at or below which a share p of the histogram falls.
+static int percentile(const unsigned long long *hist, int n, double p)
+{
+    unsigned long long total = 0, sum = 0;
+    for (int i = 0; i < n; i++)
+        total += hist[i];
+    for (int i = 0; i < n; i++) {
+        sum += hist[i];
+        if (sum >= total * p)
+            return i;
+    }
+    return n - 1;
+}
+
+static double share(unsigned long long part, unsigned long long whole)
+{
+    return whole ? (double) part / whole : 0;
+}
+
+// Decoder settings for this corpus, each as a line of advice.
+static std::vector<std::string> recommend(const corpus_stats_t &s)
+{
+    std::vector<std::string> advice;
+    char line[256];
+    int cores = std::thread::hardware_concurrency();
+    double rows = share(s.rows, s.files);
+
+    if (__builtin_cpu_supports("avx512f"))
+        advice.push_back("-t avx512: this CPU runs the AVX-512 transform; "
+                         "output stays within one gray level of -t double");
+    else
+        advice.push_back("-t float: single precision transform, within one "
+                         "gray level of -t double");
+    if (cores > 1 && rows >= 4 * cores) {
+        snprintf(line, sizeof(line), "-j %d: %.0f rows of blocks per picture "
+                 "keep every core busy", cores, rows);
+        advice.push_back(line);
+    } else if (cores > 1 && s.files > 1) {
+        snprintf(line, sizeof(line), "-b outdir -j %d: pictures are too short "
+                 "(%.0f rows) to split, decode them side by side instead",
+                 cores, rows);
+        advice.push_back(line);
+    } else {
+        advice.push_back("-j 1: no parallelism to gain on this machine");
+    }
+    int last90 = percentile(s.last, MAX_COEFS, 0.9);
+    if (s.block_size[8] && last90 < 10) {
+        snprintf(line, sizeof(line), "vpeg-enc -b 16: 90%% of blocks end by "
+                 "scan position %d, smooth content that larger blocks code "
+                 "with fewer headers", last90);
+        advice.push_back(line);
+    } else if (s.block_size[8] && percentile(s.coefs, MAX_COEFS + 1, 0.5) > 40) {
+        advice.push_back("vpeg-enc -b 4: most blocks are dense, smaller blocks "
+                         "follow the detail better");
+    }
+    if (share(s.duplicates, s.blocks) > 0.2) {
+        snprintf(line, sizeof(line), "%.0f%% of blocks repeat an earlier one, "
+                 "caching reconstructed blocks would skip that many transforms",
+                 100 * share(s.duplicates, s.blocks));
+        advice.push_back(line);
+    }
+    if (share(s.skip_bytes, s.bytes) > 0.05) {
+        snprintf(line, sizeof(line), "%.0f%% of the bytes are skip records, "
+                 "strip them upstream if nothing reads them",
+                 100 * share(s.skip_bytes, s.bytes));
+        advice.push_back(line);
+    }
+    if (s.untrusted) {
+        snprintf(line, sizeof(line), "%llu file(s) fail validation and take the "
+                 "bounds-checked decoder", s.untrusted);
+        advice.push_back(line);
+    }
+    advice.push_back("vpeg-v2: Huffman-coded tokens when bytes matter more "
+                     "than parse time");
+    return advice;
+}
+
+static void print_hist(const char *name, const unsigned long long *hist, int n)
+{
+    while (n > 1 && !hist[n - 1])
+        n--;
+    printf("%s:", name);
+    for (int i = 0; i < n; i++)
+        printf(" %llu", hist[i]);
+    printf("\n");
+}
+
+static void print_text(const corpus_stats_t &s)
+{
+    printf("files %llu (%llu unreadable or malformed), %llu bytes, %llu blocks\n",
+           s.files, s.failed, s.bytes, s.blocks);
+    printf("bytes per block %.2f, skip records %llu with %llu bytes (%.2f%%)\n",
+           share(s.bytes - s.skip_bytes, s.blocks), s.skip_records, s.skip_bytes,
+           100 * share(s.skip_bytes, s.bytes));
+    printf("coefficients per block: mean %.2f, median %d, p90 %d\n",
+           mean(s.coefs, MAX_COEFS + 1), percentile(s.coefs, MAX_COEFS + 1, 0.5),
+           percentile(s.coefs, MAX_COEFS + 1, 0.9));
+    printf("last nonzero scan index: mean %.2f, median %d, p90 %d\n",
+           mean(s.last, MAX_COEFS), percentile(s.last, MAX_COEFS, 0.5),
+           percentile(s.last, MAX_COEFS, 0.9));
+    printf("quant levels: %llu %llu %llu %llu\n", s.quant[0], s.quant[1],
+           s.quant[2], s.quant[3]);
+    printf("duplicate blocks: %llu (%.2f%%)\n", s.duplicates,
+           100 * share(s.duplicates, s.blocks));
+    print_hist("coefficients histogram", s.coefs, MAX_COEFS + 1);
+    print_hist("last index histogram", s.last, MAX_COEFS);
+    print_hist("zero runs 0..15,16+", s.runs, RUN_BUCKETS);
+    printf("suggested:\n");
+    std::vector<std::string> advice = recommend(s);
+    for (size_t i = 0; i < advice.size(); i++)
+        printf("  %s\n", advice[i].c_str());
+}
+
+static void json_hist(const char *name, const unsigned long long *hist, int n,
+                      const char *tail)
+{
+    while (n > 1 && !hist[n - 1])
+        n--;
+    printf("  \"%s\": [", name);
+    for (int i = 0; i < n; i++)
+        printf("%s%llu", i ? ", " : "", hist[i]);
+    printf("]%s\n", tail);
+}
+
+static void json_string(const std::string &str)
+{
+    putchar('"');
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '"' || str[i] == '\\')
+            putchar('\\');
+        putchar(str[i]);
+    }
+    putchar('"');
+}
+
+static void print_json(const corpus_stats_t &s)
+{
+    printf("{\n  \"files\": %llu,\n  \"failed\": %llu,\n  \"untrusted\": %llu,\n",
+           s.files, s.failed, s.untrusted);
+    printf("  \"bytes\": %llu,\n  \"blocks\": %llu,\n  \"pixels\": %llu,\n",
+           s.bytes, s.blocks, s.pixels);
+    printf("  \"bytes_per_block\": %.3f,\n", share(s.bytes - s.skip_bytes, s.blocks));
+    printf("  \"skip_records\": %llu,\n  \"skip_bytes\": %llu,\n",
+           s.skip_records, s.skip_bytes);
+    printf("  \"duplicate_blocks\": %llu,\n  \"duplicate_ratio\": %.4f,\n",
+           s.duplicates, share(s.duplicates, s.blocks));
+    printf("  \"quant_levels\": [%llu, %llu, %llu, %llu],\n", s.quant[0],
+           s.quant[1], s.quant[2], s.quant[3]);
+    printf("  \"block_sizes\": { \"4\": %llu, \"8\": %llu, \"16\": %llu },\n",
+           s.block_size[4], s.block_size[8], s.block_size[16]);
+    printf("  \"coefficients_mean\": %.3f,\n  \"last_index_mean\": %.3f,\n",
+           mean(s.coefs, MAX_COEFS + 1), mean(s.last, MAX_COEFS));
+    json_hist("coefficients_per_block", s.coefs, MAX_COEFS + 1, ",");
+    json_hist("last_nonzero_index", s.last, MAX_COEFS, ",");
+    json_hist("zero_runs", s.runs, RUN_BUCKETS, ",");
+    printf("  \"recommendations\": [");
+    std::vector<std::string> advice = recommend(s);
+    for (size_t i = 0; i < advice.size(); i++) {
+        printf("%s\n    ", i ? "," : "");
+        json_string(advice[i]);
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0, opt;
+    while ((opt = getopt(argc, argv, "J")) != -1) {
+        switch (opt) {
+        case 'J':
+            json = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    corpus_stats_t s;
+    memset(&s, 0, sizeof(s));
+    for (int i = optind; i < argc; i++)
+        if (stat_file(s, argv[i]) < 0) {
+            fprintf(stderr, "%s: unreadable or malformed.\n", argv[i]);
+            s.failed++;
+        }
+    if (json)
+        print_json(s);
+    else
+        print_text(s);
+    return s.failed != 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * vpeg-v2: convert between VPEG v1 and the Huffman-coded v2 format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-v2 input output\n"
+            "  Converts v1 to v2, or v2 back to v1, whichever the input is.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+        usage();
+
+    std::vector<unsigned char> input, output;
+    if (read_file(argv[1], input) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    int to_v1 = is_v2(input.data(), input.size());
+    double t0 = now_seconds();
+    int ret = to_v1 ? v2_to_v1(input.data(), input.size(), output)
+                    : v1_to_v2(input.data(), input.size(), output);
+    if (ret < 0) {
+        fprintf(stderr, "Malformed stream.\n");
+        return 1;
+    }
+    printf("v%d %zu bytes -> v%d %zu bytes in %.2f ms.\n", to_v1 ? 2 : 1,
+           input.size(), to_v1 ? 1 : 2, output.size(),
+           (now_seconds() - t0) * 1e3);
+    if (write_file(argv[2], output) < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * vpeg-xform: rotate, mirror, crop and shrink a VPEG stream without
+ * decoding it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vpeg.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: vpeg-xform [-o op] [-c x,y,w,h] [-b bytes] input.vpeg output.vpeg\n"
+            "  -o op       fliph, flipv, transpose, rot90, rot180 or rot270\n"
+            "              (rotations are clockwise)\n"
+            "  -c x,y,w,h  crop first, in pixels, multiples of 8\n"
+            "  -b bytes    raise block quantization levels until the stream fits\n");
+    exit(1);
+}
+
+static int parse_xform(const char *name)
+{
+    static const char *names[] = {
+        "none", "fliph", "flipv", "transpose", "rot90", "rot180", "rot270"
+    };
+    for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++)
+        if (!strcmp(name, names[i]))
+            return i;
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    int xform = XFORM_NONE, crop = 0, opt;
+    size_t budget = 0;
+    int cx = 0, cy = 0, cw = 0, ch = 0;
+    while ((opt = getopt(argc, argv, "o:c:b:")) != -1) {
+        switch (opt) {
+        case 'o':
+            if ((xform = parse_xform(optarg)) < 0)
+                usage();
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d,%d,%d", &cx, &cy, &cw, &ch) != 4 ||
+                (cx | cy | cw | ch) % 8)
+                usage();
+            crop = 1;
+            break;
+        case 'b':
+            budget = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 2 != argc)
+        usage();
+
+    std::vector<unsigned char> input, output;
+    if (read_file(argv[optind], input) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    double t0 = now_seconds();
+    coef_picture_t p, q;
+    if (parse_coefficients(input.data(), input.size(), p) < 0) {
+        fprintf(stderr, "Malformed or non-rectangular stream.\n");
+        return 1;
+    }
+    if (crop && crop_coefficients(p, cx / 8, cy / 8, cw / 8, ch / 8) < 0) {
+        fprintf(stderr, "Crop is outside the %dx%d picture.\n",
+                p.cols * 8, p.rows * 8);
+        return 1;
+    }
+    transform_coefficients(p, xform, q);
+    if (budget && requantize_to_budget(q, budget) > budget)
+        fprintf(stderr, "Cannot get below %zu bytes, using the coarsest levels.\n",
+                budget);
+    emit_coefficients(q, output);
+    double t = now_seconds() - t0;
+    printf("Wrote %dx%d, %zu bytes in %.2f ms.\n", q.cols * 8, q.rows * 8,
+           output.size(), t * 1e3);
+
+    if (write_file(argv[optind + 1], output) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,571 @@
+/*
+ * VPEG decoder core: tables, the per-block inverse transforms, and the
+ * row-parallel picture decoder built from them.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include <thread>
+
+#include "vpeg.h"
+
+/*
+ * Missing function -- part of problem;
+ *
+ * author: Victor Zamanian <victor.zamanian@gmail.com>
+ */
+void transpose(block_t &m)
+{
+    /* Increase horizontal initial index for each row. */
+    int limit = 0;
+    double temp;
+    for (int i = 0; i < 8; i++) {
+        for (int j = limit++; j < 8; j++) {
+          /* Swap m[i][j] and m[j][i]. */
+          temp = m[i][j];
+          m[i][j] = m[j][i];
+          m[j][i] = temp;
+        }
+    }
+}
+
+// Quantifization matrices: (divided by 8)
+// value=0:
+//    x 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+//    1 1 1 1 1 1 1 1
+// value=1:
+//    x 1 1 1 2 2 2 2
+//    1 1 1 1 2 2 2 2
+//    1 1 1 1 2 2 2 2
+//    1 1 1 1 2 2 2 2
+//    2 2 2 2 4 4 4 4
+//    2 2 2 2 4 4 4 4
+//    2 2 2 2 4 4 4 4
+//    2 2 2 2 4 4 4 4
+// value=2:
+//    x 2 2 2  4  4  4  4
+//    2 2 2 2  4  4  4  4
+//    2 2 2 2  4  4  4  4
+//    2 2 2 2  4  4  4  4
+//    4 4 4 4 16 16 16 16
+//    4 4 4 4 16 16 16 16
+//    4 4 4 4 16 16 16 16
+//    4 4 4 4 16 16 16 16
+//    4 4 4 4 16 16 16 16
+// value=3:
+//    x 4 4 4  8  8  8  8
+//    4 4 4 4  8  8  8  8
+//    4 4 4 4  8  8  8  8
+//    4 4 4 4  8  8  8  8
+//    8 8 8 8 64 64 64 64
+//    8 8 8 8 64 64 64 64
+//    8 8 8 8 64 64 64 64
+//    8 8 8 8 64 64 64 64
+
+int quant_values[4][3] = { { 1, 1, 1 },
+                           { 1, 2, 4 },
+                           { 2, 4, 16 },
+                           { 4, 8, 64 } };
+
+// Inverse quantization
+void dequant(block_t &m, quant_block_t &qm, int value)
+{
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+            m[y][x] = qm[y][x] * quant_values[value][(y>4) + (x>4)] * 8;
+    m[0][0] = 16384;
+}
+
+// Inverse DCT of length 8
+void idct(double *x)
+{
+    double sum[8];
+    for (int k = 0; k < 8; k++) {
+        sum[k] = (1/2.0) * x[0];
+        for (int n = 1; n < 8; n++)
+            sum[k] += x[n] * cos(M_PI / 8 * n * (k + 0.5));
+    }
+    for (int k = 0; k < 8; k++)
+        x[k] = sum[k] * (2/8.0);
+}
+
+// Inverse 8-by-8 DCT
+void idct88(block_t &m)
+{
+    for (int i = 0; i < 8; i++)
+        idct(m[i]);
+    transpose(m);
+    for (int i = 0; i < 8; i++)
+        idct(m[i]);
+}
+
+int zigzag_order[64] = { 
+     0,  2,  5,  9, 14, 20, 27, 35,  
+     1,  4,  8, 13, 19, 26, 34, 42,
+     3,  7, 12, 18, 25, 33, 41, 48,
+     6, 11, 17, 24, 32, 40, 47, 53,
+    10, 16, 23, 31, 39, 46, 52, 57,
+    15, 22, 30, 38, 45, 51, 56, 60,
+    21, 29, 37, 44, 50, 55, 59, 62,
+    28, 36, 43, 49, 54, 58, 61, 63 };
+
+// Inverse zig-zag reshuffling
+void izigzag(quant_block_t &in, quant_block_t &out)
+{
+    // Index through flat pointers; in[0][i] past the first row is undefined
+    // and gets miscompiled with optimization turned on.
+    const short *src = &in[0][0];
+    short *dst = &out[0][0];
+    for (int i = 0; i < 64; i++)
+        dst[i] = src[zigzag_order[i]];
+}
+
+
+// Inverse run-length encoding. 
+// No error checking: only streams vpeg_index() has marked trusted get here.
+int irle(quant_block_t &bl, signed char *&bitstream)
+{
+    /* Value to be returned. */
+    int quantval;
+    /* Initialize bl with zeros? */
+    memset(bl, 0, sizeof(bl));
+    /* Set m to point to bl[0] */
+    short *m = bl[0];
+    /* Skip bytes to be skipped. */
+    CHECKSKIP;
+    /* Assert that we are at the beginning of a block. */
+    assert((bitstream[0] & 0xac) == 0xa0);
+    /* Set quantval to be 0, 1, 2 or 3, depending on bitstream[0]. */
+    quantval = bitstream[0] & 0x03;
+    /* Combine the next two bytes into a short and store it. */
+    *(m++) = (bitstream[1] << 8) | (bitstream[2]);
+    /* Go to the next value. */
+    bitstream += 3;
+    while (1) {
+        /* Skip bytes to be skipped. */
+        CHECKSKIP;
+        /* If at end of block. */
+        if (((unsigned char) *bitstream) == 0xac) {
+            /* Go to the next value. */
+            bitstream++;
+            /* Return the quantization value. */
+            return quantval;
+        /* If bitstream points to a coefficient value. */
+        } else if (!(*bitstream & 0x80)) {
+            /* Fetch the xxxxxx part of the sxxxxxx in the coefficient
+               value. */
+            /* Then fetch the s part of the sxxxxxx in the coefficient
+               value. */
+            *(m++) = (*bitstream & 0x3f) * ((*bitstream & 0x40) ? -1 : 1);
+            bitstream++;
+            PROF_COUNT(coefficients, 1);
+        /* If we've bumped into a 0b100zzzzs byte. */
+        } else if ((*bitstream & 0xe0) == 0x80) {
+            /* Skip 0b0000zzzz byte (keep them as zeroes). */
+            m += (*bitstream & 0x1e) >> 1;
+            /* Fetch the next coefficient value and multiply with `s'
+               from 0b100zzzzs. */
+            *(m++) = bitstream[1] * (bitstream[0] & 0x1 ? -1 : 1);
+            /* Move to the next bitstream byte code. */
+            bitstream += 2;
+            PROF_COUNT(runs, 1);
+        }
+    }
+}
+
+int frame_alloc(frame_t &f, int width, int height)
+{
+    f.width = width;
+    f.height = height;
+    f.stride = width;
+    f.pixels = new (std::nothrow) unsigned char[(size_t) width * height];
+    if (!f.pixels)
+        return -1;
+    memset(f.pixels, 0, (size_t) width * height);
+    return 0;
+}
+
+void frame_free(frame_t &f)
+{
+    delete[] f.pixels;
+    f.pixels = NULL;
+}
+
+int write_pgm(const char *path, const frame_t &f)
+{
+    PROF_START();
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return -1;
+    fprintf(fp, "P5 %d %d 255\n", f.width, f.height);
+    for (int y = 0; y < f.height; y++)
+        fwrite(f.pixels + (size_t) y * f.stride, f.width, 1, fp);
+    int ret = fclose(fp) ? -1 : 0;
+    PROF_STAGE(PROF_WRITE);
+    return ret;
+}
+
+int read_file(const char *path, std::vector<unsigned char> &buf)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    unsigned char chunk[65536];
+    size_t n;
+    buf.clear();
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        buf.insert(buf.end(), chunk, chunk + n);
+    fclose(fp);
+    return 0;
+}
+
+int write_file(const char *path, const std::vector<unsigned char> &buf)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return -1;
+    fwrite(buf.data(), buf.size(), 1, fp);
+    return fclose(fp) ? -1 : 0;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add_skip(std::vector<skip_record_t> &skips, size_t offset, int len,
+                     int row, int col)
+{
+    skip_record_t r;
+    r.offset = offset;
+    r.len = len;
+    r.row = row;
+    r.col = col;
+    skips.push_back(r);
+}
+
+// Walks the token stream and records where every row of blocks starts.
+// Unlike irle() this checks every length against the buffer and counts the
+// coefficients of every block, so the decoder does not have to.
+int vpeg_index(const unsigned char *data, size_t len, stream_index_t &idx,
+               std::vector<skip_record_t> *skips)
+{
+    size_t p = stream_start(data, len);
+    int col = 0, last_row = -1;
+    std::vector<int> widths;
+
+    idx.rows = idx.cols = 0;
+    idx.blocks = 0;
+    idx.trusted = 1;
+    idx.embedded = 0;
+    idx.block_size = parse_block_size(data, len);
+    if (idx.block_size < 0)
+        return -1;
+    int coefs = idx.block_size * idx.block_size;
+    idx.row_offset.clear();
+    idx.row_offset.push_back(p);
+    if (skips)
+        skips->clear();
+    while (1) {
+        if (p >= len)
+            return -1;
+        unsigned char b = data[p];
+        if (b == 0xff) {
+            if (p + 1 >= len || p + 2 + data[p + 1] > len)
+                return -1;
+            if (skips)
+                add_skip(*skips, p, data[p + 1], idx.row_offset.size() - 1, col);
+            p += data[p + 1] + 2;
+        } else if (b == 0xaf) {
+            break;
+        } else if (b == 0xae) {
+            p++;
+            idx.row_offset.push_back(p);
+            widths.push_back(col);
+            col = 0;
+        } else if ((b & 0xfc) == 0xa0) {
+            /* Block header, then tokens up to the end of block. */
+            int pos = 1;
+            p += 3;
+            while (1) {
+                if (p >= len)
+                    return -1;
+                b = data[p];
+                if (b == 0xac) {
+                    p++;
+                    break;
+                } else if (b == 0xff) {
+                    if (p + 1 >= len || p + 2 + data[p + 1] > len)
+                        return -1;
+                    if (skips)
+                        add_skip(*skips, p, data[p + 1],
+                                 idx.row_offset.size() - 1, col);
+                    p += data[p + 1] + 2;
+                } else if (!(b & 0x80)) {
+                    p++;
+                    pos++;
+                } else if ((b & 0xe0) == 0x80) {
+                    p += 2;
+                    pos += ((b & 0x1e) >> 1) + 1;
+                } else {
+                    return -1;
+                }
+            }
+            if (pos > coefs)
+                idx.trusted = 0;
+            col++;
+            idx.blocks++;
+            if (col > idx.cols)
+                idx.cols = col;
+            last_row = idx.row_offset.size() - 1;
+        } else {
+            return -1;
+        }
+    }
+    idx.end = p;
+    widths.push_back(col);
+    /* Trailing row markers without blocks do not add to the height. */
+    idx.rows = last_row + 1;
+    idx.row_offset.resize(idx.rows);
+    for (int row = 0; row < idx.rows; row++)
+        if (widths[row] != idx.cols)
+            idx.trusted = 0;
+    return 0;
+}
+
+// Walks the tokens from p to the end of the row without decoding them.
+// Returns 1 at a row marker, with end just past it, 2 at the end of file,
+// with end on the 0xaf byte, 0 if the row is not complete in len bytes
+// yet, and -1 on anything that is not a token. blocks counts on from what
+// it holds, and overflow is set if a block has more than coefs
+// coefficients, which vpeg_index() would not trust. On 0, end is the first
+// block or skip record not complete yet: the scan carries on from there
+// once more bytes are in, keeping blocks and overflow.
+int scan_row(const unsigned char *data, size_t len, size_t p,
+                    int coefs, size_t &end, int &blocks, int &overflow)
+{
+    while (1) {
+        end = p;
+        if (p >= len)
+            return 0;
+        unsigned char b = data[p];
+        if (b == 0xff) {
+            if (p + 1 >= len || p + 2 + data[p + 1] > len)
+                return 0;
+            p += data[p + 1] + 2;
+        } else if (b == 0xaf) {
+            end = p;
+            return 2;
+        } else if (b == 0xae) {
+            end = p + 1;
+            return 1;
+        } else if ((b & 0xfc) == 0xa0) {
+            int pos = 1;
+            p += 3;
+            while (1) {
+                if (p >= len)
+                    return 0;
+                b = data[p];
+                if (b == 0xac) {
+                    p++;
+                    break;
+                } else if (b == 0xff) {
+                    if (p + 1 >= len || p + 2 + data[p + 1] > len)
+                        return 0;
+                    p += data[p + 1] + 2;
+                } else if (!(b & 0x80)) {
+                    p++;
+                    pos++;
+                } else if ((b & 0xe0) == 0x80) {
+                    p += 2;
+                    pos += ((b & 0x1e) >> 1) + 1;
+                } else {
+                    return -1;
+                }
+            }
+            if (pos > coefs)
+                overflow = 1;
+            blocks++;
+        } else {
+            return -1;
+        }
+    }
+}
+
+// Everything after parsing: zig-zag, dequantization, IDCT and the store of
+// block (row, col) into the picture. zqb is in scan order.
+void reconstruct_block(quant_block_t &zqb, int quantvalue, frame_t &f,
+                       int row, int col)
+{
+    quant_block_t qb;
+    if ((row + 1) * 8 > f.height || (col + 1) * 8 > f.width)
+        return;
+    PROF_START();
+    // Inverse zig-zag
+    izigzag(zqb, qb);
+    PROF_STAGE(PROF_ZIGZAG);
+    unsigned char *dst = f.pixels + (size_t) row * 8 * f.stride + col * 8;
+    if (vpeg_transform != TRANSFORM_DOUBLE) {
+        // Dequantization, inverse DCT and store in one go
+        reconstruct_float(qb, quantvalue, dst, f.stride);
+        PROF_STAGE(PROF_IDCT);
+        return;
+    }
+    block_t bl;
+    // Dequantify
+    dequant(bl, qb, quantvalue);
+    PROF_STAGE(PROF_DEQUANT);
+    // Inverse DCT
+    idct88(bl);
+    PROF_STAGE(PROF_IDCT);
+    // Map block to picture
+    for (int y = 0; y < 8; y++) {
+        // Round-off errors may turn values in slightly less than 0,
+        // or slightly greater than 255. Here we make sure it fits
+        // within a byte.
+#define CLAMP(val) ((val) < 0 ? 0 : ((val) > 255 ? 255 : (val)))
+        for (int x = 0; x < 8; x++)
+            dst[x] = (unsigned char) CLAMP(bl[y][x]);
+        dst += f.stride;
+    }
+    PROF_STAGE(PROF_STORE);
+}
+
+// Decode one block and map it to the picture at block position (row, col).
+// Returns its quantization level.
+int decode_block(unsigned char *&bitstream, frame_t &f, int row, int col)
+{
+    quant_block_t zqb;
+    PROF_START();
+#ifdef VPEG_PROFILE
+    unsigned long long block_start = prof_t;
+#endif
+    // Inverse RLE
+    int quantvalue = irle(zqb, (signed char *&) bitstream);
+    PROF_STAGE(PROF_PARSE);
+    reconstruct_block(zqb, quantvalue, f, row, col);
+#ifdef VPEG_PROFILE
+    int coefs = 0;
+    for (int i = 0; i < 64; i++)
+        coefs += zqb[i / 8][i % 8] != 0;
+    PROF_BLOCK(coefs, block_start);
+#endif
+    return quantvalue;
+}
+
+// Decode the blocks of one row, up to the next row marker or end of file.
+void decode_row(unsigned char *bitstream, frame_t &f, int row,
+                unsigned char *quant)
+{
+    int col = 0;
+    while (1) {
+        CHECKSKIP;
+        if (*bitstream == 0xae || *bitstream == 0xaf)
+            return;
+        int quantvalue = decode_block(bitstream, f, row, col);
+        if (quant && (col + 1) * 8 <= f.width)
+            quant[col] = quantvalue + 1;
+        col++;
+    }
+}
+
+// decode_row() for streams that failed validation: coefficients past the
+// end of a block are dropped instead of written over the stack.
+void decode_row_checked(unsigned char *bitstream, frame_t &f, int row,
+                        unsigned char *quant)
+{
+    quant_block_t zqb;
+    for (int col = 0; ; col++) {
+        CHECKSKIP;
+        if (*bitstream == 0xae || *bitstream == 0xaf)
+            return;
+        PROF_START();
+        int quantvalue = parse_block(&zqb[0][0], 8, bitstream);
+        reconstruct_block(zqb, quantvalue, f, row, col);
+        PROF_BLOCK(prof_coefficients(&zqb[0][0], 64), prof_t);
+        if (quant && (col + 1) * 8 <= f.width)
+            quant[col] = quantvalue + 1;
+    }
+}
+
+// Returns -1 if the row is left out, only ever for an embedded index.
+static int decode_indexed_row(unsigned char *data, const stream_index_t &idx,
+                              frame_t &f, int row, deblock_t *d)
+{
+    unsigned char *quant = d ? deblock_quant(*d, row) : NULL;
+    int trusted = idx.embedded ? check_embedded_row(data, idx, row) : idx.trusted;
+    if (trusted < 0) {
+        if (d)
+            deblock_row(*d, row);
+        return -1;
+    }
+    if (idx.block_size == 8 && trusted)
+        decode_row(data + idx.row_offset[row], f, row, quant);
+    else if (idx.block_size == 8)
+        decode_row_checked(data + idx.row_offset[row], f, row, quant);
+    else
+        decode_row_n(data + idx.row_offset[row], idx.block_size, f, row, quant);
+    if (d)
+        deblock_row(*d, row);
+    return 0;
+}
+
+int vpeg_decode_indexed(unsigned char *data, const stream_index_t &idx,
+                        frame_t &f, int threads)
+{
+    PROF_START();
+    std::atomic<int> failed(0);
+    deblock_t deblock, *d = NULL;
+    if (vpeg_deblock) {
+        deblock_init(deblock, f, idx.block_size);
+        d = &deblock;
+    }
+    if (threads > idx.rows)
+        threads = idx.rows;
+    if (threads <= 1) {
+        for (int row = 0; row < idx.rows; row++)
+            failed += decode_indexed_row(data, idx, f, row, d) < 0;
+    } else {
+        /* Workers pull the next undecoded row until there are none left. */
+        std::atomic<int> next_row(0);
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.push_back(std::thread([&]() {
+                int row;
+                while ((row = next_row++) < idx.rows)
+                    failed += decode_indexed_row(data, idx, f, row, d) < 0;
+            }));
+        for (size_t t = 0; t < pool.size(); t++)
+            pool[t].join();
+    }
+    PROF_IMAGE(prof_t);
+    return failed;
+}
+
+int vpeg_decode(unsigned char *data, size_t len, frame_t &f, int threads)
+{
+    stream_index_t idx;
+    /* An embedded index saves the scan, unless it turns out to be wrong. */
+    if (vpeg_embedded_index(data, len, idx) == 0 &&
+        vpeg_decode_indexed(data, idx, f, threads) == 0)
+        return 0;
+    if (vpeg_index(data, len, idx) < 0)
+        return -1;
+    for (int y = 0; y < f.height; y++)
+        memset(f.pixels + (size_t) y * f.stride, 0, f.width);
+    vpeg_decode_indexed(data, idx, f, threads);
+    return 0;
+}
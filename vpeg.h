@@ -0,0 +1,311 @@
+/*
+ * VPEG decoder core, shared by decompressor and the vpeg-* tools.
+ *
+ * See the introduction at the top of decompressor.cpp for a description of
+ * the stream format.
+ */
+#ifndef VPEG_H
+#define VPEG_H
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+typedef double block_t[8][8];
+typedef short quant_block_t[8][8];
+
+extern int quant_values[4][3];
+extern int zigzag_order[64];
+
+#include "profile.h"
+
+#define CHECKSKIP while (((unsigned char) bitstream[0]) == 0xff) { \
+        PROF_COUNT(skip_records, 1); \
+        PROF_COUNT(skip_bytes, (unsigned char) bitstream[1]); \
+        bitstream += ((unsigned char) bitstream[1]) + 2; }
+
+void transpose(block_t &m);
+void dequant(block_t &m, quant_block_t &qm, int value);
+void idct(double *x);
+void idct88(block_t &m);
+void izigzag(quant_block_t &in, quant_block_t &out);
+int irle(quant_block_t &bl, signed char *&bitstream);
+
+// Gray-scale picture, one byte per pixel, stride bytes between rows.
+struct frame_t {
+    int width, height, stride;
+    unsigned char *pixels;
+};
+
+// Largest picture a decoder allocates for a geometry it read from a stream.
+#define VPEG_MAX_PIXELS (256L << 20)
+
+// frame_alloc() returns -1, with pixels NULL, if they cannot be allocated.
+int frame_alloc(frame_t &f, int width, int height);
+void frame_free(frame_t &f);
+int write_pgm(const char *path, const frame_t &f);
+int read_file(const char *path, std::vector<unsigned char> &buf);
+int write_file(const char *path, const std::vector<unsigned char> &buf);
+
+// Where each row of blocks starts, found without decoding anything.
+//
+// Building it also validates the stream: every token fits in the buffer,
+// which ends in 0xaf, or vpeg_index() fails. trusted is set when, on top
+// of that, no block has more coefficients than fit in it and every row has
+// the same number of blocks. Only then do rows go through irle(), which
+// checks nothing; other streams take a slower bounds-checked path.
+//
+// An index read from the stream itself by vpeg_embedded_index() has
+// embedded set instead, and its rows are checked one by one as they are
+// decoded.
+struct stream_index_t {
+    int rows, cols;                   // geometry in blocks
+    int block_size;                   // 8 unless the stream says otherwise
+    int trusted;
+    int embedded;
+    long blocks;                      // total number of blocks
+    size_t end;                       // offset of the 0xaf byte
+    std::vector<size_t> row_offset;   // first byte of each row
+};
+
+// A 0xff skip record. The payload is left in the stream, at offset + 2.
+struct skip_record_t {
+    size_t offset;          // of the 0xff byte
+    int len;
+    int row, col;           // block the record precedes or sits inside
+};
+
+// Passing skips also collects every skip record on the way, which makes
+// this a metadata-only scan: no block is ever parsed into coefficients.
+int vpeg_index(const unsigned char *data, size_t len, stream_index_t &idx,
+               std::vector<skip_record_t> *skips = NULL);
+int scan_row(const unsigned char *data, size_t len, size_t p, int coefs,
+             size_t &end, int &blocks, int &overflow);
+
+// The same index, scanned by threads threads that each guess where a block
+// starts in their share of the stream (speculate.cpp). Shares of less than
+// min_chunk bytes are not split off. rescanned, if given, is set to the
+// number of shares that guessed wrong and were scanned again.
+int vpeg_index_speculative(const unsigned char *data, size_t len,
+                           stream_index_t &idx, int threads,
+                           size_t min_chunk = 65536, int *rescanned = NULL);
+
+// Row index embedded in skip records at the start of the stream
+// (rowindex.cpp). vpeg_embedded_index() fills idx from it without looking
+// at any block, or fails if there is no complete index.
+// check_embedded_row() is what the decoders run on such a row first: -1
+// if it does not end where the next one starts, the last one at the 0xaf,
+// or does not hold cols blocks, else whether it may go through irle().
+int is_row_index_record(const unsigned char *payload, int len);
+void emit_row_index(std::vector<unsigned char> &out, int rows, int cols,
+                    const std::vector<size_t> &offsets);
+int vpeg_strip_index(const unsigned char *data, size_t len,
+                     std::vector<unsigned char> &out);
+int vpeg_embed_index(const unsigned char *data, size_t len,
+                     std::vector<unsigned char> &out);
+int vpeg_embedded_index(const unsigned char *data, size_t len,
+                        stream_index_t &idx);
+int check_embedded_row(const unsigned char *data, const stream_index_t &idx,
+                       int row);
+
+// Decoding. Rows of blocks are independent of each other, so with
+// threads > 1 they are handed out to a pool of workers. The decode loops
+// return how many rows of an embedded index failed their check and were
+// left out, 0 otherwise. The row decoders
+// store 1 + the quantization level of each block that fits in f in quant,
+// if given.
+void reconstruct_block(quant_block_t &zqb, int quantvalue, frame_t &f,
+                       int row, int col);
+int decode_block(unsigned char *&bitstream, frame_t &f, int row, int col);
+void decode_row(unsigned char *bitstream, frame_t &f, int row,
+                unsigned char *quant = NULL);
+void decode_row_checked(unsigned char *bitstream, frame_t &f, int row,
+                        unsigned char *quant = NULL);
+int vpeg_decode_indexed(unsigned char *data, const stream_index_t &idx,
+                        frame_t &f, int threads);
+int vpeg_decode(unsigned char *data, size_t len, frame_t &f, int threads);
+
+// Block-major frames (tiled.cpp): block (row, col) is block_size squared
+// contiguous bytes at tiles + (row * cols + col) * block_size^2, and an
+// 8x8 tile is one cache line. Decode into one, then get raster pixels
+// with tiled_export() for a region or write_pgm_tiled() for all of it.
+struct tiled_frame_t {
+    int width, height;      // in pixels
+    int block_size;
+    int cols, rows;         // in tiles
+    unsigned char *tiles;   // cache line aligned
+};
+
+int tiled_alloc(tiled_frame_t &t, int width, int height, int block_size);
+void tiled_free(tiled_frame_t &t);
+int vpeg_decode_tiled(unsigned char *data, const stream_index_t &idx,
+                      tiled_frame_t &t, int threads);
+void tiled_export(const tiled_frame_t &t, int x, int y, frame_t &f);
+int write_pgm_tiled(const char *path, const tiled_frame_t &t);
+
+// In-loop deblocking (deblock.cpp), on in both decode loops while
+// vpeg_deblock is set. A loop calls deblock_init() before its first row,
+// has the row decoder fill deblock_quant(row) and then calls
+// deblock_row(), from any worker and in any order of rows.
+struct deblock_t {
+    int block_size, cols, rows;
+    unsigned char *pixels;
+    int stride, tiled;
+    std::vector<unsigned char> quant;         // 1 + level per block, 0 if none
+    std::vector<std::atomic<int> > ready;     // finished rows next to a seam
+};
+
+extern int vpeg_deblock;
+void deblock_init(deblock_t &d, frame_t &f, int block_size);
+void deblock_init_tiled(deblock_t &d, tiled_frame_t &t);
+unsigned char *deblock_quant(deblock_t &d, int row);
+void deblock_row(deblock_t &d, int row);
+
+// Single precision inverse transforms (idct_float.cpp). reconstruct_block()
+// switches to one once transform_select() has checked that it stays within
+// one gray level of idct88(); it returns the transform it settled on. Any
+// but TRANSFORM_DOUBLE also puts block_engine<N> in single precision, which
+// engine_error() checks the same way.
+enum { TRANSFORM_DOUBLE, TRANSFORM_FLOAT, TRANSFORM_AVX512 };
+extern int vpeg_transform;
+int transform_select(int want);
+const char *transform_name(int t);
+void reconstruct_float(const quant_block_t &qb, int quantvalue,
+                       unsigned char *dst, int stride);
+
+// Block sizes 4, 8 and 16 (engine.cpp). zz is n * n coefficients in scan
+// order; parse_block_size() returns what the stream header asks for, 8
+// without one, or -1 for an unsupported size. stream_start() is the offset
+// of the first row, past that header.
+int valid_block_size(int n);
+int parse_block_size(const unsigned char *data, size_t len);
+size_t stream_start(const unsigned char *data, size_t len);
+void emit_block_size(std::vector<unsigned char> &out, int n);
+int parse_block(short *zz, int n, unsigned char *&bitstream);
+int engine_error(void);
+void reconstruct_block_n(const short *zz, int n, int quantval, frame_t &f,
+                         int row, int col);
+void encode_block_n(const frame_t &f, int n, int row, int col, int quantval,
+                    short *zz);
+void decode_row_n(unsigned char *bitstream, int n, frame_t &f, int row,
+                  unsigned char *quant = NULL);
+
+// Token writer (writer.cpp). zz holds the 64 coefficients in zig-zag scan
+// order, i.e. in the order irle() produces them. Magnitudes up to 128, all
+// that a stream can hold, are written exactly; larger ones are clamped to
+// 128 and counted in the return value.
+int emit_block(std::vector<unsigned char> &out, const short *zz, int quantval,
+               int count = 64);
+void emit_skip(std::vector<unsigned char> &out, const unsigned char *payload,
+               int len);
+void emit_row_end(std::vector<unsigned char> &out);
+void emit_eof(std::vector<unsigned char> &out);
+
+// Decode service on a Unix domain socket (server.cpp). Only returns on
+// failure.
+int vpeg_serve(const char *path, int workers);
+
+// Batch decoding of many files into outdir, through io_uring when the
+// kernel has it (batch.cpp). Returns the number of failed files, or -1.
+int vpeg_batch(char **inputs, int count, const char *outdir, int workers,
+               int depth);
+
+// VPEG v2, Huffman-coded tokens with a row index (entropy.cpp).
+int is_v2(const unsigned char *data, size_t len);
+int v1_to_v2(unsigned char *data, size_t len, std::vector<unsigned char> &out);
+// v2_to_v1() fails on magnitudes above 128, which v1 cannot hold.
+int v2_to_v1(const unsigned char *data, size_t len, std::vector<unsigned char> &out);
+int v2_geometry(const unsigned char *data, size_t len, int &cols, int &rows);
+int v2_decode(const unsigned char *data, size_t len, frame_t &f, int threads);
+
+// Encoder (encoder.cpp).
+void fdct88(block_t &m);
+void quant(quant_block_t &qm, block_t &m, int value);
+void zigzag(quant_block_t &in, quant_block_t &out);
+void encode_coefficients(const frame_t &f, int row, int col, int quantval,
+                         quant_block_t &qm);
+void vpeg_encode(const frame_t &f, int quantval, int threads,
+                 std::vector<unsigned char> &out, int block_size = 8);
+int read_pgm(const char *path, frame_t &f);
+
+// Frame sequences with conditional block replenishment (sequence.cpp).
+struct seq_encoder_t {
+    int width, height;            // of every frame, in pixels
+    int cols, rows, quantval, frames;
+    std::vector<short> coefs;     // last coefficients sent, 64 per block
+    std::vector<unsigned char> pixels;    // previous frame
+};
+
+struct seq_decoder_t {
+    int cols, rows, frames;
+    frame_t frame;                // persists from one frame to the next
+    std::vector<int> dirty;       // row * cols + col of blocks just decoded
+};
+
+void seq_encoder_init(seq_encoder_t &s, int width, int height, int quantval);
+int seq_encode_frame(seq_encoder_t &s, const frame_t &f,
+                     std::vector<unsigned char> &out);
+int is_sequence_record(const unsigned char *payload, int len);
+// seq_decode_frame() returns 1 for a frame, 0 at the end of the stream and
+// -1 for a malformed frame, which leaves s.frame untouched.
+int seq_decoder_init(seq_decoder_t &s, unsigned char *&bitstream, size_t len);
+int seq_decode_frame(seq_decoder_t &s, unsigned char *&bitstream,
+                     const unsigned char *end);
+
+// Coefficient-domain transcoding (transcode.cpp). Only rectangular pictures
+// are accepted, and of a sequence only the first frame.
+struct coef_block_t {
+    quant_block_t c;        // raster order, c[0][0] the DC value as written
+    int quantval;
+};
+
+struct coef_picture_t {
+    int rows, cols;
+    std::vector<coef_block_t> blocks;
+    std::vector<std::vector<unsigned char> > skips;   // skip record payloads
+};
+
+enum {
+    XFORM_NONE, XFORM_FLIP_H, XFORM_FLIP_V, XFORM_TRANSPOSE,
+    XFORM_ROT90, XFORM_ROT180, XFORM_ROT270
+};
+
+int parse_coefficients(unsigned char *data, size_t len, coef_picture_t &p);
+void emit_coefficients(const coef_picture_t &p, std::vector<unsigned char> &out);
+void transform_coefficients(const coef_picture_t &in, int xform,
+                            coef_picture_t &out);
+int crop_coefficients(coef_picture_t &p, int col0, int row0, int cols, int rows);
+void requantize_block(const coef_block_t &in, int quantval, coef_block_t &out);
+size_t requantize_to_budget(coef_picture_t &p, size_t budget);
+
+// Differential conformance checks (conform.cpp): every decode mode against
+// the double-precision reference on inputs plus a generated corpus, then
+// fuzz_iterations mutated streams through every parser. Returns the number
+// of failures.
+struct conform_input_t {
+    std::string name;
+    std::vector<unsigned char> data;
+};
+
+int vpeg_conform(std::vector<conform_input_t> &inputs, int fuzz_iterations,
+                 unsigned long seed);
+
+// Synthetic stream generator (synth.cpp).
+struct synth_params_t {
+    int width, height;      // in pixels, multiples of 8
+    double density;         // mean number of nonzero AC coefficients per block
+    double quant_mix[4];    // relative weight of each quantization level
+    double run_length;      // mean zero-run between nonzero coefficients
+    double skip_rate;       // probability of a 0xff record before a block
+    double dup_ratio;       // probability of repeating the previous block
+    unsigned long seed;
+};
+
+void synth_defaults(synth_params_t &p);
+void synth_stream(const synth_params_t &p, std::vector<unsigned char> &out);
+int synth_option(synth_params_t &p, int opt, const char *arg);
+
+double now_seconds(void);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * VPEG token writer: the inverse of irle().
+ */
+
+#include <stdlib.h>
+
+#include "vpeg.h"
+
+int emit_block(std::vector<unsigned char> &out, const short *zz, int quantval,
+               int count)
+{
+    int clamped = 0;
+    /* Start of block, quantization level and big-endian DC value. */
+    out.push_back(0xa0 | (quantval & 0x03));
+    out.push_back((zz[0] >> 8) & 0xff);
+    out.push_back(zz[0] & 0xff);
+
+    /* Trailing zeros are implicit, irle() clears the block first. */
+    int last = count - 1;
+    while (last > 0 && zz[last] == 0)
+        last--;
+
+    int zeros = 0;
+    for (int i = 1; i <= last; i++) {
+        if (zz[i] == 0) {
+            zeros++;
+            continue;
+        }
+        /* Runs longer than zzzz can hold are split up with explicit zero
+           coefficients: 0x9e 0x00 is 15 zeros followed by a zero. */
+        while (zeros > 15) {
+            out.push_back(0x9e);
+            out.push_back(0x00);
+            zeros -= 16;
+        }
+        int sign = zz[i] < 0;
+        int value = abs(zz[i]);
+        if (value > 128) {
+            value = 128;
+            clamped++;
+        }
+        if (zeros == 0 && value < 64) {
+            out.push_back((sign << 6) | value);
+        } else if (value == 128) {
+            /* The run byte is signed: -128, negated by the sign bit. */
+            out.push_back(0x80 | (zeros << 1) | !sign);
+            out.push_back(0x80);
+        } else {
+            out.push_back(0x80 | (zeros << 1) | sign);
+            out.push_back(value);
+        }
+        zeros = 0;
+    }
+    out.push_back(0xac);
+    return clamped;
+}
+
+void emit_skip(std::vector<unsigned char> &out, const unsigned char *payload,
+               int len)
+{
+    out.push_back(0xff);
+    out.push_back(len);
+    out.insert(out.end(), payload, payload + len);
+}
+
+void emit_row_end(std::vector<unsigned char> &out)
+{
+    out.push_back(0xae);
+}
+
+void emit_eof(std::vector<unsigned char> &out)
+{
+    out.push_back(0xaf);
+}